@@ -0,0 +1,1183 @@
+/* fraction.h - header-only exact fraction type
+ *
+ * fraction<T> stores a numerator and denominator of integer type T (int,
+ * long, long long, __int128 or their unsigned versions). Construction,
+ * arithmetic, comparison and reduction are constexpr, so fractions built
+ * from constants fold at compile time. Results that do not fit in T are
+ * promoted to an arbitrary-precision bigfraction at run time and demoted
+ * again by simp() once they fit. sum() and product() fold a whole range in a
+ * balanced tree, optionally on several threads.
+ *
+ * Building with -DFRACTION_COUNTERS counts operations, GCD steps and
+ * promotions at run time and prints the totals to stderr at exit.
+ *
+ * Cara Ditmar, Autumn 2019
+ */
+
+#ifndef FRACTION_H
+#define FRACTION_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <climits>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#ifdef FRACTION_COUNTERS
+#include <atomic>
+#include <type_traits>
+#endif
+
+/* Per-type choices for fraction<T>: the unsigned type used for magnitudes
+ * and GCDs, and a type that holds the product of two T exactly, which lets
+ * add() and mult() skip the crosswise GCDs. __int128 has no wider type.
+ */
+template <typename T> struct fractionTraits;
+
+template <> struct fractionTraits<int> {
+    typedef unsigned int unsignedType;
+    typedef long long wideType;
+    static constexpr bool isSigned = true;
+    static constexpr bool hasWide = true;
+    static constexpr int maxValue = INT_MAX;
+};
+
+template <> struct fractionTraits<long> {
+    typedef unsigned long unsignedType;
+    typedef __int128 wideType;
+    static constexpr bool isSigned = true;
+    static constexpr bool hasWide = sizeof(long) < sizeof(__int128);
+    static constexpr long maxValue = LONG_MAX;
+};
+
+template <> struct fractionTraits<long long> {
+    typedef unsigned long long unsignedType;
+    typedef __int128 wideType;
+    static constexpr bool isSigned = true;
+    static constexpr bool hasWide = true;
+    static constexpr long long maxValue = LLONG_MAX;
+};
+
+template <> struct fractionTraits<__int128> {
+    typedef unsigned __int128 unsignedType;
+    typedef void wideType;
+    static constexpr bool isSigned = true;
+    static constexpr bool hasWide = false;
+    static constexpr __int128 maxValue = (__int128)(~(unsigned __int128)0 >> 1);
+};
+
+template <> struct fractionTraits<unsigned int> {
+    typedef unsigned int unsignedType;
+    typedef unsigned long long wideType;
+    static constexpr bool isSigned = false;
+    static constexpr bool hasWide = true;
+    static constexpr unsigned int maxValue = UINT_MAX;
+};
+
+template <> struct fractionTraits<unsigned long> {
+    typedef unsigned long unsignedType;
+    typedef unsigned __int128 wideType;
+    static constexpr bool isSigned = false;
+    static constexpr bool hasWide = sizeof(long) < sizeof(__int128);
+    static constexpr unsigned long maxValue = ULONG_MAX;
+};
+
+template <> struct fractionTraits<unsigned long long> {
+    typedef unsigned long long unsignedType;
+    typedef unsigned __int128 wideType;
+    static constexpr bool isSigned = false;
+    static constexpr bool hasWide = true;
+    static constexpr unsigned long long maxValue = ULLONG_MAX;
+};
+
+template <> struct fractionTraits<unsigned __int128> {
+    typedef unsigned __int128 unsignedType;
+    typedef void wideType;
+    static constexpr bool isSigned = false;
+    static constexpr bool hasWide = false;
+    static constexpr unsigned __int128 maxValue = ~(unsigned __int128)0;
+};
+
+#ifdef FRACTION_COUNTERS
+/* Run-time event totals across all fraction types and threads */
+struct fractionCounters {
+    std::atomic<unsigned long long> adds, subs, mults, divs, compares;
+    std::atomic<unsigned long long> simps, gcdSteps;
+    std::atomic<unsigned long long> promotions, demotions;
+    ~fractionCounters(void);
+};
+
+inline fractionCounters fractionCounts;
+
+/* Adds n to one counter, except while the compiler evaluates a constant */
+#define FRACTION_COUNT(event, n) \
+    do { \
+        if (!std::is_constant_evaluated()) { \
+            fractionCounts.event.fetch_add(n, std::memory_order_relaxed); \
+        } \
+    } while (0)
+#else
+#define FRACTION_COUNT(event, n) do { (void)(n); } while (0)
+#endif
+
+/* Arbitrary-precision signed integer, only used once a fraction overflows */
+class bignum {
+private:
+    // Sign and magnitude, 32-bit limbs with the least significant first
+    bool negative;
+    std::vector<uint32_t> limbs;
+public:
+    // Class constructors
+    bignum(void);
+    template <typename T> explicit bignum(T value);
+    // Arithmetic
+    friend bignum operator+(const bignum &a, const bignum &b);
+    friend bignum operator-(const bignum &a, const bignum &b);
+    friend bignum operator*(const bignum &a, const bignum &b);
+    // Exact division by a divisor of this number
+    bignum divExact(const bignum &divisor) const;
+    // Greatest common divisor of the magnitudes
+    static bignum gcd(bignum a, bignum b);
+    // Three-way comparison of signed values
+    static int compare(const bignum &a, const bignum &b);
+    // Sign queries
+    bool isZero(void) const;
+    bool isNegative(void) const;
+    void negate(void);
+    // Narrows to T if the value fits
+    template <typename T> bool fits(T &out) const;
+    // Decimal representation
+    std::string toString(void) const;
+private:
+    static int compareMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b);
+    static std::vector<uint32_t> addMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b);
+    static std::vector<uint32_t> subMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b);
+    static void shiftRight(std::vector<uint32_t> &a, unsigned int bits);
+    static void shiftLeft(std::vector<uint32_t> &a, unsigned int bits);
+    static unsigned int trailingZeros(const std::vector<uint32_t> &a);
+    static void trim(std::vector<uint32_t> &a);
+};
+
+/* A fraction held in the big representation */
+struct bigfraction {
+    bignum numerator;
+    bignum denominator;
+};
+
+/* A fraction stored as two T. Arithmetic is checked; a result that does not
+ * fit in T is promoted to a bigfraction, and simp() demotes it again once
+ * the reduced value fits.
+ */
+template <typename T>
+class fraction {
+private:
+    typedef fractionTraits<T> traits;
+    typedef typename traits::unsignedType U;
+    // Internal representation of a fraction as two integers
+    T numerator;
+    T denominator;
+    // Arbitrary-precision value, NULL while the fraction fits in T
+    bigfraction *big;
+public:
+    // Class constructors
+    constexpr fraction(T n, T d = 1) : numerator(n), denominator(d), big(NULL) {}
+    constexpr fraction(const fraction &f);
+    constexpr fraction(fraction &&f);
+    constexpr fraction &operator=(const fraction &f);
+    constexpr fraction &operator=(fraction &&f);
+    constexpr ~fraction(void);
+    // Methods to update the fraction
+    constexpr void add(const fraction &f);
+    constexpr void sub(const fraction &f);
+    constexpr void mult(const fraction &f);
+    constexpr void div(const fraction &f);
+    // Simplify fraction
+    constexpr void simp(void);
+    // Exact three-way comparison: -1, 0 or 1
+    constexpr int compare(const fraction &f) const;
+    // Display method
+    void display(void) const;
+    // Text form "n / d", without a newline
+    std::string toString(void) const;
+    // Accessors, only meaningful while the fraction is not promoted
+    constexpr bool isPromoted(void) const { return big != NULL; }
+    constexpr T getNumerator(void) const { return numerator; }
+    constexpr T getDenominator(void) const { return denominator; }
+private:
+    template <typename W> constexpr bool narrow(W n, W d);
+    constexpr void multiply(T n, T d);
+    void addBig(const fraction &f, bool subtract);
+    void multBig(const fraction &f, bool reciprocal);
+    void simpBig(void);
+    int compareBig(const fraction &f) const;
+    void promote(const bignum &n, const bignum &d);
+    bigfraction toBig(void) const;
+};
+
+template <typename T> constexpr fraction<T> operator+(fraction<T> a, const fraction<T> &b);
+template <typename T> constexpr fraction<T> operator-(fraction<T> a, const fraction<T> &b);
+template <typename T> constexpr fraction<T> operator*(fraction<T> a, const fraction<T> &b);
+template <typename T> constexpr fraction<T> operator/(fraction<T> a, const fraction<T> &b);
+template <typename T> constexpr bool operator==(const fraction<T> &a, const fraction<T> &b);
+template <typename T> constexpr bool operator!=(const fraction<T> &a, const fraction<T> &b);
+template <typename T> constexpr bool operator<(const fraction<T> &a, const fraction<T> &b);
+template <typename T> constexpr bool operator>(const fraction<T> &a, const fraction<T> &b);
+template <typename T> constexpr bool operator<=(const fraction<T> &a, const fraction<T> &b);
+template <typename T> constexpr bool operator>=(const fraction<T> &a, const fraction<T> &b);
+
+template <typename It> typename std::iterator_traits<It>::value_type sum(It first, It last, int threads = 1);
+template <typename It> typename std::iterator_traits<It>::value_type product(It first, It last, int threads = 1);
+template <typename F, typename Combine> F reduceTree(std::vector<F> level, const F &identity, Combine combine, int threads);
+
+constexpr int countTrailingZeros(unsigned int x);
+constexpr int countTrailingZeros(unsigned long x);
+constexpr int countTrailingZeros(unsigned long long x);
+constexpr int countTrailingZeros(unsigned __int128 x);
+template <typename U> constexpr U gcd(U a, U b);
+template <typename U> constexpr int compareRatios(U a, U b, U c, U d);
+template <typename T> constexpr bool isNegative(T x);
+template <typename T> constexpr typename fractionTraits<T>::unsignedType magnitude(T x);
+template <typename T> constexpr T divideMagnitude(T x, typename fractionTraits<T>::unsignedType g);
+template <typename T> std::string formatInteger(T value);
+template <typename T> char *writeInteger(char *out, T value);
+
+
+/* Copies a fraction, including its big value if promoted */
+template <typename T>
+constexpr fraction<T>::fraction(const fraction &f) {
+    numerator = f.numerator;
+    denominator = f.denominator;
+    big = f.big != NULL ? new bigfraction(*f.big) : NULL;
+}
+
+
+/* Takes over the big value of f */
+template <typename T>
+constexpr fraction<T>::fraction(fraction &&f) {
+    numerator = f.numerator;
+    denominator = f.denominator;
+    big = f.big;
+    f.big = NULL;
+}
+
+
+/* Assigns a fraction, including its big value if promoted */
+template <typename T>
+constexpr fraction<T> &fraction<T>::operator=(const fraction &f) {
+    if (this != &f) {
+        delete big;
+        numerator = f.numerator;
+        denominator = f.denominator;
+        big = f.big != NULL ? new bigfraction(*f.big) : NULL;
+    }
+    return *this;
+}
+
+
+template <typename T>
+constexpr fraction<T> &fraction<T>::operator=(fraction &&f) {
+    if (this != &f) {
+        delete big;
+        numerator = f.numerator;
+        denominator = f.denominator;
+        big = f.big;
+        f.big = NULL;
+    }
+    return *this;
+}
+
+
+/* Frees the big value */
+template <typename T>
+constexpr fraction<T>::~fraction(void) {
+    delete big;
+}
+
+
+/* Displays a fraction */
+template <typename T>
+void fraction<T>::display() const {
+    std::cout << toString() << std::endl;
+}
+
+
+/* Formats a fraction as "n / d" */
+template <typename T>
+std::string fraction<T>::toString() const {
+    if (big != NULL) {
+        return big->numerator.toString() + " / " + big->denominator.toString();
+    }
+    return formatInteger(numerator) + " / " + formatInteger(denominator);
+}
+
+
+/* Adds 2 fractions. With a wide type the cross products are exact and only
+ * reduced if they do not fit; otherwise the sum is taken over the least
+ * common multiple of the denominators.
+ */
+template <typename T>
+constexpr void fraction<T>::add(const fraction &f) {
+    FRACTION_COUNT(adds, 1);
+    if (big == NULL && f.big == NULL) {
+        if constexpr (traits::hasWide) {
+            typedef typename traits::wideType W;
+            W n = 0;
+            if (!__builtin_add_overflow((W)numerator * f.denominator, (W)f.numerator * denominator, &n) &&
+                narrow(n, (W)denominator * f.denominator)) {
+                return;
+            }
+        } else {
+            U g = gcd(magnitude(denominator), magnitude(f.denominator));
+            if (g == 0) {
+                g = 1;      // both denominators are zero
+            }
+            T scale = divideMagnitude(f.denominator, g);
+            T otherScale = divideMagnitude(denominator, g);
+            T left = 0, right = 0, n = 0, d = 0;
+            if (!__builtin_mul_overflow(numerator, scale, &left) &&
+                !__builtin_mul_overflow(f.numerator, otherScale, &right) &&
+                !__builtin_add_overflow(left, right, &n) &&
+                !__builtin_mul_overflow(denominator, scale, &d)) {
+                numerator = n;
+                denominator = d;
+                return;
+            }
+        }
+    }
+    addBig(f, false);
+}
+
+
+/* Subtracts 2 fractions; an unsigned T promotes when the result is negative */
+template <typename T>
+constexpr void fraction<T>::sub(const fraction &f) {
+    FRACTION_COUNT(subs, 1);
+    if (big == NULL && f.big == NULL) {
+        if constexpr (traits::hasWide) {
+            typedef typename traits::wideType W;
+            W n = 0;
+            if (!__builtin_sub_overflow((W)numerator * f.denominator, (W)f.numerator * denominator, &n) &&
+                narrow(n, (W)denominator * f.denominator)) {
+                return;
+            }
+        } else {
+            U g = gcd(magnitude(denominator), magnitude(f.denominator));
+            if (g == 0) {
+                g = 1;
+            }
+            T scale = divideMagnitude(f.denominator, g);
+            T otherScale = divideMagnitude(denominator, g);
+            T left = 0, right = 0, n = 0, d = 0;
+            if (!__builtin_mul_overflow(numerator, scale, &left) &&
+                !__builtin_mul_overflow(f.numerator, otherScale, &right) &&
+                !__builtin_sub_overflow(left, right, &n) &&
+                !__builtin_mul_overflow(denominator, scale, &d)) {
+                numerator = n;
+                denominator = d;
+                return;
+            }
+        }
+    }
+    addBig(f, true);
+}
+
+
+/* Multiplies 2 fractions */
+template <typename T>
+constexpr void fraction<T>::mult(const fraction &f) {
+    FRACTION_COUNT(mults, 1);
+    if (big == NULL && f.big == NULL) {
+        multiply(f.numerator, f.denominator);
+        return;
+    }
+    multBig(f, false);
+}
+
+
+/* Divides 2 fractions by multiplying with the reciprocal */
+template <typename T>
+constexpr void fraction<T>::div(const fraction &f) {
+    FRACTION_COUNT(divs, 1);
+    if (big == NULL && f.big == NULL) {
+        multiply(f.denominator, f.numerator);
+        return;
+    }
+    multBig(f, true);
+}
+
+
+/* Multiplies by n / d. With a wide type the products are exact; otherwise
+ * common factors are cancelled crosswise first.
+ */
+template <typename T>
+constexpr void fraction<T>::multiply(T n, T d) {
+    if constexpr (traits::hasWide) {
+        typedef typename traits::wideType W;
+        if (narrow((W)numerator * n, (W)denominator * d)) {
+            return;
+        }
+    } else {
+        U g1 = gcd(magnitude(numerator), magnitude(d));
+        U g2 = gcd(magnitude(n), magnitude(denominator));
+        if (g1 == 0) {
+            g1 = 1;
+        }
+        if (g2 == 0) {
+            g2 = 1;
+        }
+        T newN = 0, newD = 0;
+        if (!__builtin_mul_overflow(divideMagnitude(numerator, g1), divideMagnitude(n, g2), &newN) &&
+            !__builtin_mul_overflow(divideMagnitude(denominator, g2), divideMagnitude(d, g1), &newD)) {
+            numerator = newN;
+            denominator = newD;
+            return;
+        }
+    }
+    fraction other(n, d);
+    multBig(other, false);
+}
+
+
+/* Stores n / d computed in the wide type W, reducing it first if it does
+ * not fit in T. Returns false if it does not fit even then.
+ */
+template <typename T>
+template <typename W>
+constexpr bool fraction<T>::narrow(W n, W d) {
+    if ((W)(T)n != n || (W)(T)d != d) {
+        typename fractionTraits<W>::unsignedType g = gcd(magnitude(n), magnitude(d));
+        if (g > 1) {
+            n = divideMagnitude(n, g);
+            d = divideMagnitude(d, g);
+        }
+        if ((W)(T)n != n || (W)(T)d != d) {
+            return false;
+        }
+    }
+    numerator = (T)n;
+    denominator = (T)d;
+    return true;
+}
+
+
+/* Simplifies a fraction by its greatest common divisor and moves the sign
+ * to the numerator. 0 / d becomes 0 / 1 and n / 0 becomes +-1 / 0. A reduced
+ * value that does not fit in T with a positive denominator is promoted instead.
+ */
+template <typename T>
+constexpr void fraction<T>::simp(void) {
+    FRACTION_COUNT(simps, 1);
+    if (big == NULL) {
+        U n = magnitude(numerator);
+        U d = magnitude(denominator);
+        bool negative = isNegative(numerator) != isNegative(denominator);
+        U g = gcd(n, d);
+        if (g == 0) {
+            return;     // 0 / 0 has nothing to reduce
+        }
+        n /= g;
+        d /= g;
+        if (n == 0) {
+            d = 1;
+            negative = false;
+        }
+        U limit = (U)traits::maxValue;
+        if (d <= limit && (negative ? n <= limit + 1 : n <= limit)) {
+            // n may be 2^(bits-1) here, which only fits as the minimum of T
+            numerator = negative ? (T)((U)0 - n) : (T)n;
+            denominator = (T)d;
+            return;
+        }
+    }
+    simpBig();
+}
+
+
+/* Compares exactly. Values of different sign are ordered without
+ * multiplying. With a wide type the cross products are compared, which
+ * cannot overflow; without one, the magnitudes are compared by
+ * compareRatios. Only promoted values and zero denominators go to bignum.
+ */
+template <typename T>
+constexpr int fraction<T>::compare(const fraction &f) const {
+    FRACTION_COUNT(compares, 1);
+    if (big == NULL && f.big == NULL && denominator != 0 && f.denominator != 0) {
+        int sign = numerator == 0 ? 0 : isNegative(numerator) != isNegative(denominator) ? -1 : 1;
+        int otherSign = f.numerator == 0 ? 0 : isNegative(f.numerator) != isNegative(f.denominator) ? -1 : 1;
+        if (sign != otherSign) {
+            return sign < otherSign ? -1 : 1;
+        }
+        if constexpr (!traits::hasWide) {
+            // exact in U, so neither needs promoting to bignum
+            int order = compareRatios(magnitude(numerator), magnitude(denominator),
+                                      magnitude(f.numerator), magnitude(f.denominator));
+            return sign < 0 ? -order : order;
+        }
+    }
+    if constexpr (traits::hasWide) {
+        if (big == NULL && f.big == NULL) {
+            typedef typename traits::wideType W;
+            W left = (W)numerator * f.denominator;
+            W right = (W)f.numerator * denominator;
+            int order = left < right ? -1 : left > right ? 1 : 0;
+            // cross-multiplying by a negative denominator flips the order
+            return isNegative(denominator) != isNegative(f.denominator) ? -order : order;
+        }
+    }
+    return compareBig(f);
+}
+
+
+/* Adds or subtracts in the big representation */
+template <typename T>
+void fraction<T>::addBig(const fraction &f, bool subtract) {
+    bigfraction a = toBig();
+    bigfraction b = f.toBig();
+    bignum left = a.numerator * b.denominator;
+    bignum right = b.numerator * a.denominator;
+    promote(subtract ? left - right : left + right, a.denominator * b.denominator);
+}
+
+
+/* Multiplies by f, or by its reciprocal, in the big representation */
+template <typename T>
+void fraction<T>::multBig(const fraction &f, bool reciprocal) {
+    bigfraction a = toBig();
+    bigfraction b = f.toBig();
+    if (reciprocal) {
+        std::swap(b.numerator, b.denominator);
+    }
+    promote(a.numerator * b.numerator, a.denominator * b.denominator);
+}
+
+
+/* Reduces in the big representation and demotes to T if the result fits */
+template <typename T>
+void fraction<T>::simpBig(void) {
+    if (big == NULL) {
+        promote(bignum(numerator), bignum(denominator));
+    }
+    bignum g = bignum::gcd(big->numerator, big->denominator);
+    if (g.isZero()) {
+        return;
+    }
+    bignum n = big->numerator.divExact(g);
+    bignum d = big->denominator.divExact(g);
+    if (d.isNegative()) {
+        n.negate();
+        d.negate();
+    }
+    if (n.isZero()) {
+        d = bignum(1);
+    }
+    T smallN = 0, smallD = 0;
+    if (n.fits(smallN) && d.fits(smallD)) {
+        FRACTION_COUNT(demotions, 1);
+        delete big;
+        big = NULL;
+        numerator = smallN;
+        denominator = smallD;
+        return;
+    }
+    big->numerator = n;
+    big->denominator = d;
+}
+
+
+template <typename T>
+int fraction<T>::compareBig(const fraction &f) const {
+    bigfraction a = toBig();
+    bigfraction b = f.toBig();
+    int order = bignum::compare(a.numerator * b.denominator, b.numerator * a.denominator);
+    return a.denominator.isNegative() != b.denominator.isNegative() ? -order : order;
+}
+
+
+/* Switches the fraction to the big representation */
+template <typename T>
+void fraction<T>::promote(const bignum &n, const bignum &d) {
+    if (big == NULL) {
+        FRACTION_COUNT(promotions, 1);
+        big = new bigfraction;
+    }
+    big->numerator = n;
+    big->denominator = d;
+}
+
+
+/* Returns the fraction in the big representation */
+template <typename T>
+bigfraction fraction<T>::toBig(void) const {
+    if (big != NULL) {
+        return *big;
+    }
+    bigfraction b;
+    b.numerator = bignum(numerator);
+    b.denominator = bignum(denominator);
+    return b;
+}
+
+
+/* Reduced sum, difference, product and quotient */
+template <typename T>
+constexpr fraction<T> operator+(fraction<T> a, const fraction<T> &b) {
+    a.add(b);
+    a.simp();
+    return a;
+}
+
+template <typename T>
+constexpr fraction<T> operator-(fraction<T> a, const fraction<T> &b) {
+    a.sub(b);
+    a.simp();
+    return a;
+}
+
+template <typename T>
+constexpr fraction<T> operator*(fraction<T> a, const fraction<T> &b) {
+    a.mult(b);
+    a.simp();
+    return a;
+}
+
+template <typename T>
+constexpr fraction<T> operator/(fraction<T> a, const fraction<T> &b) {
+    a.div(b);
+    a.simp();
+    return a;
+}
+
+
+/* Comparisons by value, so 1 / 2 == 2 / 4 */
+template <typename T>
+constexpr bool operator==(const fraction<T> &a, const fraction<T> &b) {
+    return a.compare(b) == 0;
+}
+
+template <typename T>
+constexpr bool operator!=(const fraction<T> &a, const fraction<T> &b) {
+    return a.compare(b) != 0;
+}
+
+template <typename T>
+constexpr bool operator<(const fraction<T> &a, const fraction<T> &b) {
+    return a.compare(b) < 0;
+}
+
+template <typename T>
+constexpr bool operator>(const fraction<T> &a, const fraction<T> &b) {
+    return a.compare(b) > 0;
+}
+
+template <typename T>
+constexpr bool operator<=(const fraction<T> &a, const fraction<T> &b) {
+    return a.compare(b) <= 0;
+}
+
+template <typename T>
+constexpr bool operator>=(const fraction<T> &a, const fraction<T> &b) {
+    return a.compare(b) >= 0;
+}
+
+
+/* Sum of the fractions in [first, last). Adding left to right lets the
+ * denominator grow with every term; pairing terms in a balanced tree and
+ * reducing each partial sum keeps it to the LCM of the denominators below
+ * each node.
+ */
+template <typename It>
+typename std::iterator_traits<It>::value_type sum(It first, It last, int threads) {
+    typedef typename std::iterator_traits<It>::value_type F;
+    return reduceTree(std::vector<F>(first, last), F(0), [](F &a, const F &b) {
+        a.add(b);
+        a.simp();
+    }, threads);
+}
+
+
+/* Product of the fractions in [first, last), combined as sum() does */
+template <typename It>
+typename std::iterator_traits<It>::value_type product(It first, It last, int threads) {
+    typedef typename std::iterator_traits<It>::value_type F;
+    return reduceTree(std::vector<F>(first, last), F(1), [](F &a, const F &b) {
+        a.mult(b);
+        a.simp();
+    }, threads);
+}
+
+
+/* Folds level with combine(a, b), which replaces a by a op b, one tree level
+ * at a time: element i of the next level combines elements 2i and 2i + 1.
+ * A level with enough pairs is split into contiguous slices, one per thread.
+ */
+template <typename F, typename Combine>
+F reduceTree(std::vector<F> level, const F &identity, Combine combine, int threads) {
+    const size_t minPairsPerThread = 1024;
+    if (level.empty()) {
+        return identity;
+    }
+    std::vector<F> next;
+    while (level.size() > 1) {
+        size_t pairs = level.size() / 2;
+        next.assign((level.size() + 1) / 2, identity);
+        auto combineRange = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                next[i] = std::move(level[2 * i]);
+                combine(next[i], level[2 * i + 1]);
+            }
+        };
+        size_t workers = std::min((size_t)std::max(threads, 1), pairs / minPairsPerThread);
+        if (workers <= 1) {
+            combineRange(0, pairs);
+        } else {
+            std::vector<std::thread> pool;
+            for (size_t w = 1; w < workers; w++) {
+                pool.push_back(std::thread(combineRange, pairs * w / workers, pairs * (w + 1) / workers));
+            }
+            combineRange(0, pairs / workers);
+            for (size_t w = 0; w < pool.size(); w++) {
+                pool[w].join();
+            }
+        }
+        if (level.size() % 2 != 0) {
+            next[pairs] = std::move(level.back());     // odd one out moves up a level
+        }
+        level.swap(next);
+    }
+    F result = std::move(level[0]);
+    result.simp();      // a single input was never combined
+    return result;
+}
+
+
+/* Computes the greatest common divisor with Stein's binary algorithm.
+ * gcd(a, 0) is a, and gcd(0, 0) is 0.
+ */
+template <typename U>
+constexpr U gcd(U a, U b) {
+    if (a == 0) {
+        return b;
+    }
+    if (b == 0) {
+        return a;
+    }
+    // factors of two shared by both numbers are restored at the end
+    int shift = countTrailingZeros(a | b);
+    unsigned long long steps = 0;
+    a >>= countTrailingZeros(a);
+    while (b != 0) {
+        b >>= countTrailingZeros(b);
+        if (a > b) {
+            U t = a;
+            a = b;
+            b = t;
+        }
+        b -= a;     // difference of two odd numbers is even
+        steps++;
+    }
+    FRACTION_COUNT(gcdSteps, steps);
+    return a << shift;
+}
+
+
+/* Compares a / b with c / d, for nonzero b and d, without multiplying:
+ * once the integer parts are equal, r / b against s / d for the remainders
+ * orders as d / s against b / r, as in Euclid's algorithm. Returns -1, 0
+ * or 1.
+ */
+template <typename U>
+constexpr int compareRatios(U a, U b, U c, U d) {
+    while (true) {
+        U whole = a / b;
+        U otherWhole = c / d;
+        if (whole != otherWhole) {
+            return whole < otherWhole ? -1 : 1;
+        }
+        U r = a % b;
+        U s = c % d;
+        if (r == 0 || s == 0) {
+            return r == s ? 0 : r == 0 ? -1 : 1;
+        }
+        a = d;
+        c = b;
+        b = s;
+        d = r;
+    }
+}
+
+
+/* Trailing zero count of a nonzero value */
+constexpr int countTrailingZeros(unsigned int x) {
+    return __builtin_ctz(x);
+}
+
+constexpr int countTrailingZeros(unsigned long x) {
+    return __builtin_ctzl(x);
+}
+
+constexpr int countTrailingZeros(unsigned long long x) {
+    return __builtin_ctzll(x);
+}
+
+constexpr int countTrailingZeros(unsigned __int128 x) {
+    uint64_t low = (uint64_t)x;
+    return low != 0 ? __builtin_ctzll(low) : 64 + __builtin_ctzll((uint64_t)(x >> 64));
+}
+
+
+/* x < 0, and always false for unsigned T */
+template <typename T>
+constexpr bool isNegative(T x) {
+    if constexpr (fractionTraits<T>::isSigned) {
+        return x < 0;
+    } else {
+        return false;
+    }
+}
+
+
+/* Absolute value as an unsigned integer, defined for the minimum of T */
+template <typename T>
+constexpr typename fractionTraits<T>::unsignedType magnitude(T x) {
+    typedef typename fractionTraits<T>::unsignedType U;
+    return isNegative(x) ? (U)0 - (U)x : (U)x;
+}
+
+
+/* Divides x by a divisor g of its magnitude, keeping the sign of x */
+template <typename T>
+constexpr T divideMagnitude(T x, typename fractionTraits<T>::unsignedType g) {
+    typedef typename fractionTraits<T>::unsignedType U;
+    U q = magnitude(x) / g;
+    return isNegative(x) ? (T)((U)0 - q) : (T)q;
+}
+
+
+/* Formats any supported integer type, including __int128 */
+template <typename T>
+std::string formatInteger(T value) {
+    char buf[48];
+    return std::string(buf, writeInteger(buf, value));
+}
+
+
+/* Writes the decimal digits of value at out and returns the end */
+template <typename T>
+char *writeInteger(char *out, T value) {
+    typename fractionTraits<T>::unsignedType m = magnitude(value);
+    char digits[40];
+    char *p = digits + sizeof(digits);
+    do {
+        *--p = (char)('0' + (int)(m % 10));
+        m /= 10;
+    } while (m != 0);
+    if (isNegative(value)) {
+        *out++ = '-';
+    }
+    size_t n = digits + sizeof(digits) - p;
+    memcpy(out, p, n);
+    return out + n;
+}
+
+
+#ifdef FRACTION_COUNTERS
+inline fractionCounters::~fractionCounters(void) {
+    fprintf(stderr, "fraction counters: add %llu, sub %llu, mult %llu, div %llu, compare %llu\n",
+            adds.load(), subs.load(), mults.load(), divs.load(), compares.load());
+    fprintf(stderr, "                   simp %llu, gcd steps %llu, promotions %llu, demotions %llu\n",
+            simps.load(), gcdSteps.load(), promotions.load(), demotions.load());
+}
+#endif
+
+
+/* Constructs zero */
+inline bignum::bignum(void) {
+    negative = false;
+}
+
+
+/* Constructs a bignum from any supported integer type */
+template <typename T>
+bignum::bignum(T value) {
+    typename fractionTraits<T>::unsignedType m = magnitude(value);
+    negative = ::isNegative(value);
+    while (m != 0) {
+        limbs.push_back((uint32_t)m);
+        m >>= 16;       // two shifts so 32-bit types never shift by their width
+        m >>= 16;
+    }
+}
+
+
+inline bignum operator+(const bignum &a, const bignum &b) {
+    bignum r;
+    if (a.negative == b.negative) {
+        r.limbs = bignum::addMagnitude(a.limbs, b.limbs);
+        r.negative = a.negative;
+    } else if (bignum::compareMagnitude(a.limbs, b.limbs) >= 0) {
+        r.limbs = bignum::subMagnitude(a.limbs, b.limbs);
+        r.negative = a.negative;
+    } else {
+        r.limbs = bignum::subMagnitude(b.limbs, a.limbs);
+        r.negative = b.negative;
+    }
+    if (r.limbs.empty()) {
+        r.negative = false;
+    }
+    return r;
+}
+
+
+inline bignum operator-(const bignum &a, const bignum &b) {
+    bignum negB = b;
+    negB.negate();
+    return a + negB;
+}
+
+
+/* Schoolbook multiplication */
+inline bignum operator*(const bignum &a, const bignum &b) {
+    bignum r;
+    if (a.isZero() || b.isZero()) {
+        return r;
+    }
+    r.limbs.assign(a.limbs.size() + b.limbs.size(), 0);
+    for (size_t i = 0; i < a.limbs.size(); i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < b.limbs.size(); j++) {
+            uint64_t cur = (uint64_t)a.limbs[i] * b.limbs[j] + r.limbs[i + j] + carry;
+            r.limbs[i + j] = (uint32_t)cur;
+            carry = cur >> 32;
+        }
+        r.limbs[i + b.limbs.size()] = (uint32_t)carry;
+    }
+    bignum::trim(r.limbs);
+    r.negative = a.negative != b.negative;
+    return r;
+}
+
+
+/* Shift-and-subtract long division; the remainder is known to be zero */
+inline bignum bignum::divExact(const bignum &divisor) const {
+    bignum q;
+    std::vector<uint32_t> rem;
+    q.limbs.assign(limbs.size(), 0);
+    for (size_t i = limbs.size() * 32; i-- > 0; ) {
+        shiftLeft(rem, 1);
+        if ((limbs[i / 32] >> (i % 32)) & 1) {
+            if (rem.empty()) {
+                rem.push_back(1);
+            } else {
+                rem[0] |= 1;
+            }
+        }
+        if (compareMagnitude(rem, divisor.limbs) >= 0) {
+            rem = subMagnitude(rem, divisor.limbs);
+            q.limbs[i / 32] |= (uint32_t)1 << (i % 32);
+        }
+    }
+    trim(q.limbs);
+    q.negative = !q.limbs.empty() && (negative != divisor.negative);
+    return q;
+}
+
+
+/* Binary GCD on magnitudes, as for the fixed-width types */
+inline bignum bignum::gcd(bignum a, bignum b) {
+    a.negative = false;
+    b.negative = false;
+    if (a.isZero()) {
+        return b;
+    }
+    if (b.isZero()) {
+        return a;
+    }
+    unsigned int shift = std::min(trailingZeros(a.limbs), trailingZeros(b.limbs));
+    shiftRight(a.limbs, trailingZeros(a.limbs));
+    while (!b.isZero()) {
+        shiftRight(b.limbs, trailingZeros(b.limbs));
+        if (compareMagnitude(a.limbs, b.limbs) > 0) {
+            std::swap(a.limbs, b.limbs);
+        }
+        b.limbs = subMagnitude(b.limbs, a.limbs);
+    }
+    shiftLeft(a.limbs, shift);
+    return a;
+}
+
+
+inline bool bignum::isZero(void) const {
+    return limbs.empty();
+}
+
+
+inline bool bignum::isNegative(void) const {
+    return negative;
+}
+
+
+inline void bignum::negate(void) {
+    negative = !negative && !limbs.empty();
+}
+
+/* -1, 0 or 1 as a is less than, equal to or greater than b */
+inline int bignum::compare(const bignum &a, const bignum &b) {
+    if (a.negative != b.negative) {
+        return a.negative ? -1 : 1;
+    }
+    int order = compareMagnitude(a.limbs, b.limbs);
+    return a.negative ? -order : order;
+}
+
+
+/* Stores the value in out and returns true if it fits in T */
+template <typename T>
+bool bignum::fits(T &out) const {
+    typedef typename fractionTraits<T>::unsignedType U;
+    if (limbs.size() > (sizeof(U) + 3) / 4) {
+        return false;
+    }
+    U m = 0;
+    for (size_t i = limbs.size(); i-- > 0; ) {
+        m = (U)(m << 16 << 16) | limbs[i];
+    }
+    U limit = (U)fractionTraits<T>::maxValue;
+    if (negative ? m > limit + 1 : m > limit) {
+        return false;
+    }
+    out = negative ? (T)((U)0 - m) : (T)m;
+    return true;
+}
+
+
+/* Decimal representation, nine digits at a time */
+inline std::string bignum::toString(void) const {
+    if (limbs.empty()) {
+        return "0";
+    }
+    std::vector<uint32_t> m = limbs;
+    std::vector<uint32_t> chunks;
+    while (!m.empty()) {
+        uint64_t rem = 0;
+        for (size_t i = m.size(); i-- > 0; ) {
+            uint64_t cur = (rem << 32) | m[i];
+            m[i] = (uint32_t)(cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+        trim(m);
+        chunks.push_back((uint32_t)rem);
+    }
+    std::string s = negative ? "-" : "";
+    s += std::to_string(chunks.back());
+    char buf[16];
+    for (size_t i = chunks.size() - 1; i-- > 0; ) {
+        snprintf(buf, sizeof(buf), "%09u", chunks[i]);
+        s += buf;
+    }
+    return s;
+}
+
+
+inline int bignum::compareMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+    if (a.size() != b.size()) {
+        return a.size() < b.size() ? -1 : 1;
+    }
+    for (size_t i = a.size(); i-- > 0; ) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+
+inline std::vector<uint32_t> bignum::addMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+    const std::vector<uint32_t> &longer = a.size() >= b.size() ? a : b;
+    const std::vector<uint32_t> &shorter = a.size() >= b.size() ? b : a;
+    std::vector<uint32_t> r(longer.size() + 1, 0);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < longer.size(); i++) {
+        uint64_t cur = (uint64_t)longer[i] + (i < shorter.size() ? shorter[i] : 0) + carry;
+        r[i] = (uint32_t)cur;
+        carry = cur >> 32;
+    }
+    r[longer.size()] = (uint32_t)carry;
+    trim(r);
+    return r;
+}
+
+
+/* a - b for |a| >= |b| */
+inline std::vector<uint32_t> bignum::subMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+    std::vector<uint32_t> r(a.size(), 0);
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        int64_t cur = (int64_t)a[i] - (i < b.size() ? b[i] : 0) - borrow;
+        borrow = cur < 0;
+        r[i] = (uint32_t)(cur + (borrow << 32));
+    }
+    trim(r);
+    return r;
+}
+
+
+inline void bignum::shiftRight(std::vector<uint32_t> &a, unsigned int bits) {
+    size_t words = bits / 32;
+    bits %= 32;
+    if (words >= a.size()) {
+        a.clear();
+        return;
+    }
+    a.erase(a.begin(), a.begin() + words);
+    if (bits != 0) {
+        for (size_t i = 0; i < a.size(); i++) {
+            uint32_t high = i + 1 < a.size() ? a[i + 1] << (32 - bits) : 0;
+            a[i] = (a[i] >> bits) | high;
+        }
+    }
+    trim(a);
+}
+
+
+inline void bignum::shiftLeft(std::vector<uint32_t> &a, unsigned int bits) {
+    if (a.empty()) {
+        return;
+    }
+    size_t words = bits / 32;
+    bits %= 32;
+    if (bits != 0) {
+        a.push_back(0);
+        for (size_t i = a.size(); i-- > 0; ) {
+            uint32_t low = i > 0 ? a[i - 1] >> (32 - bits) : 0;
+            a[i] = (a[i] << bits) | low;
+        }
+    }
+    a.insert(a.begin(), words, 0);
+    trim(a);
+}
+
+
+inline unsigned int bignum::trailingZeros(const std::vector<uint32_t> &a) {
+    unsigned int bits = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i] != 0) {
+            return bits + __builtin_ctz(a[i]);
+        }
+        bits += 32;
+    }
+    return bits;
+}
+
+
+/* Drops high zero limbs so that zero is the empty vector */
+inline void bignum::trim(std::vector<uint32_t> &a) {
+    while (!a.empty() && a.back() == 0) {
+        a.pop_back();
+    }
+}
+
+#endif
@@ -1,37 +1,411 @@
 /* This program takes in 2 fractions and an operator and computes the desired problem.
  * It then simplifies and prints the result.
  * Cara Ditmar, Autumn 2019
+ *
+ * Usage: ./fractions                 (reads "n / d op n / d" lines from stdin)
+ *        ./fractions --stream [file]   (same output, reads through mmap or a large buffer)
+ *        ./fractions --threads N [file]  (evaluates line-aligned chunks on N threads, one job per line)
+ *        --simd (with --stream or --threads) evaluates blocks of jobs with the fractionArray kernels
+ *        --cache N (with --stream or --threads) caches up to N job results and N reductions,
+ *                  and prints the hit rates to stderr at exit
+ *        ./fractions --expr [file]   (evaluates one expression per line, e.g. "1/2 + 3/4 * 5/6 div 7/8")
+ *        ./fractions --reduce sum|product [--threads N] [file]  (folds all "n / d" in the input into one)
+ *        ./fractions --sort [file]   (prints every "n / d" in the input reduced, in ascending order)
+ *        --in-format text|binary, --out-format text|binary (with the job modes) read jobs and write
+ *                  results as binary records instead of text
+ *        ./fractions --convert jobs|results --in-format F --out-format F [file]
+ *                                    (rewrites job or result records from one format into the other)
+ *        ./fractions --bench         (compares the GCD reduction against the old trial-division loop,
+ *                                     eager against deferred reduction of expressions, text
+ *                                     against binary job decoding, and comparison against keyed sorting,
+ *                                     then times each operation with percentiles)
+ *
+ * Build: g++ -std=gnu++20 -O2 -pthread -o fractions fractions.cpp
+ *        add -DFRACTION_COUNTERS to print operation and promotion counts at exit
  */
 
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <climits>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_CLONES __attribute__((target_clones("avx2", "sse4.1", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+#include "fraction.h"
 
 using namespace std;
 
-class fraction {
+/* Fractions of ints stored as separate 32-byte aligned arrays of numerators
+ * and denominators, with element-wise kernels that use AVX2 or SSE4.1 when
+ * the CPU has them. A lane whose result does not fit in an int, or that
+ * involves a zero denominator or INT_MIN, is marked for fallback and must be
+ * recomputed with fraction<long long>.
+ */
+class fractionArray {
 private:
-    // Internal representation of a fraction as two integers
-    int numerator;
-    int denominator;
+    int *numerators;
+    int *denominators;
+    uint8_t *fallback;
+    size_t count;
+    size_t capacity;
+    // Magnitudes and GCDs for the kernels
+    vector<uint32_t> scratch;
 public:
-    // Class constructor
-    fraction(int n, int d);
-    // Methods to update the fraction
-    void add(fraction f);
-    void mult(fraction f);
-    void div(fraction f);
-    // Simplify fraction
+    // Class constructors
+    fractionArray(void);
+    fractionArray(const fractionArray &f) = delete;
+    fractionArray &operator=(const fractionArray &f) = delete;
+    ~fractionArray(void);
+    // Appends n / d and returns its lane
+    size_t push(int n, int d);
+    void clear(void) { count = 0; }
+    size_t size(void) const { return count; }
+    // Element-wise updates with the same lane of f
+    void add(const fractionArray &f);
+    void mult(const fractionArray &f);
+    void div(const fractionArray &f);
+    // Simplify every lane
     void simp(void);
-    // Display method
-    void display(void);
+    // Lane accessors
+    bool needsFallback(size_t i) const { return fallback[i] != 0; }
+    int getNumerator(size_t i) const { return numerators[i]; }
+    int getDenominator(size_t i) const { return denominators[i]; }
+private:
+    void reserve(size_t n);
+    uint32_t *scratchLanes(int k) { return scratch.data() + k * capacity; }
+    void multiply(const int *n2, const int *d2, const uint8_t *otherFallback);
+};
+
+/* One input line: two fractions and an operator */
+struct job {
+    long long n1, d1, n2, d2;
+    char op;    // '+', '*', 'd' for div, or '?' for an unknown operator
+};
+
+/* Binary records, an alternative to the "n / d" text. Integers are zigzag
+ * LEB128 varints, so values near zero take one byte.
+ *   job:     the op byte of struct job, then n1, d1, n2 and d2
+ *   result:  'f' then n and d, or for a promoted result 'b', a varint
+ *            length and that many bytes of "n / d" text
+ */
+const size_t maxVarintBytes = 10;
+const size_t maxJobRecordBytes = 1 + 4 * maxVarintBytes;
+
+/* Parentheses an expression may nest; the parser and evaluator recurse once
+ * per level
+ */
+const int maxExpressionDepth = 256;
+
+/* Batches formatted results and writes them with one write() per block.
+ * With fd -1 nothing is written and the buffer grows instead, so a worker
+ * can collect a chunk's results and hand them over with release().
+ */
+class outputBuffer {
+private:
+    int fd;
+    vector<char> data;
+    size_t used;
+    bool binary;    // results are written as binary records
+public:
+    outputBuffer(int fd, size_t capacity, bool binary = false);
+    ~outputBuffer(void);
+    // Room for at least n more bytes, flushing first if needed
+    char *reserve(size_t n);
+    void commit(char *end) { used = end - data.data(); }
+    void append(const char *s, size_t n);
+    void flush(void);
+    // Moves the buffered bytes into out (memory buffers only)
+    void release(vector<char> &out);
+    bool isBinary(void) const { return binary; }
+};
+
+/* A line-aligned slice of the input and its formatted results */
+struct chunk {
+    const char *begin;
+    const char *end;
+    vector<char> output;
+    bool stopped;   // hit a malformed job, so nothing after it is printed
+    bool done;
+};
+
+/* Chunk indices owned by one worker. The owner takes from the front, idle
+ * workers steal from the back.
+ */
+struct workQueue {
+    mutex lock;
+    deque<size_t> chunks;
+};
+
+/* Hit and miss counts of a resultCache */
+struct cacheStats {
+    unsigned long long jobHits, jobMisses;
+    unsigned long long simpHits, simpMisses;
+};
+
+/* Bounded caches in front of evaluateJob. The job table maps a normalized
+ * (n1, d1, op, n2, d2) to its reduced result, and the simp table maps an
+ * unreduced fraction to its reduced form, so different jobs with the same
+ * raw result share one reduction. Both use open addressing with a short
+ * linear probe; when the probe finds no free slot the home slot is
+ * overwritten, so memory stays at the capacity given. Promoted results are
+ * not cached.
+ */
+class resultCache {
+private:
+    struct jobEntry {
+        long long n1, d1, n2, d2;
+        long long n, d;
+        char op;        // 0 for an empty slot
+    };
+    struct simpEntry {
+        long long n, d;
+        long long reducedN, reducedD;
+        bool used;
+    };
+    static const size_t probeLimit = 8;
+    vector<jobEntry> jobs;
+    vector<simpEntry> simps;
+    size_t mask;
+    cacheStats counters;
+public:
+    // Room for at least capacity entries in each table
+    explicit resultCache(size_t capacity);
+    // Stores the result of j in n / d and returns true if it is cached
+    bool findJob(const job &j, long long &n, long long &d);
+    void storeJob(const job &j, long long n, long long d);
+    // Simplifies f, reusing an earlier reduction of the same fraction
+    void simp(fraction<long long> &f);
+    const cacheStats &stats(void) const { return counters; }
+private:
+    static job normalize(const job &j);
+    static size_t hash(long long a, long long b, long long c, long long d, char op);
+};
+
+/* Routes a block of parsed jobs through fractionArray batches, one pair of
+ * arrays per operator, and writes the results in job order. With a cache,
+ * a job found there skips the lanes and a lane's result is stored in it.
+ */
+class batchEvaluator {
+private:
+    // Where each pending job went: operator 0-2 and lane, -1 for scalar, or
+    // -2 for a result found in the cache
+    struct slot {
+        int op;
+        size_t lane;
+        long long n, d;     // the cached result
+    };
+    fractionArray left[3];
+    fractionArray right[3];
+    vector<job> jobs;
+    vector<slot> slots;
+public:
+    static const size_t blockSize = 4096;
+    void push(const job &j, resultCache *cache);
+    bool full(void) const { return jobs.size() >= blockSize; }
+    // Jobs that fall back to the scalar path go through cache, if any
+    void flush(outputBuffer &out, resultCache *cache);
 };
 
-int main() {
-    int n1 = 0;
-    int d1 = 0;
-    int n2 = 0;
-    int d2 = 0;
+/* A parsed expression over fractions. * and div bind tighter than + and -,
+ * and parentheses group. Evaluation leaves intermediates unreduced: the
+ * operations only reduce when a result would not fit in a long long, and
+ * the answer is simplified once at the end.
+ */
+class expression {
+private:
+    // A fraction leaf (op 'n') or an operator applied to two subtrees
+    struct node {
+        char op;        // 'n', '+', '-', '*' or 'd' for div
+        long long n, d;
+        int left, right;
+        int up;         // the node whose left operand this is, or -1
+    };
+    vector<node> nodes;
+    int root;
+    int depth;          // parentheses open while parsing
+public:
+    // Parses one expression from p up to end. Returns false on a syntax error
+    // or parentheses nested deeper than maxExpressionDepth.
+    bool parse(const char *p, const char *end);
+    // Reduces once at the end, or when an intermediate was promoted
+    fraction<long long> evaluate(void) const;
+    // Reduces after every operation, as the one-operator mode does
+    fraction<long long> evaluateEager(void) const;
+private:
+    const char *parseSum(const char *p, const char *end, int &out);
+    const char *parseProduct(const char *p, const char *end, int &out);
+    const char *parseOperand(const char *p, const char *end, int &out);
+    fraction<long long> evaluateNode(int i, bool eager) const;
+};
+
+/* A sort key for sortFractions: the words of a long double quotient, set
+ * up to order as unsigned integers, high word first
+ */
+struct sortKey {
+    uint64_t low;
+    uint32_t high;
+    uint32_t index;     // of the fraction in the input
+};
+
+const char *scanJob(const char *p, const char *end, job &j);
+const char *scanJobRecord(const char *p, const char *end, job &j);
+const char *skipJobRecord(const char *p, const char *end);
+void evaluateJob(const job &j, outputBuffer &out, resultCache *cache);
+void computeJob(const job &j, outputBuffer &out, resultCache *cache);
+void writeFraction(const fraction<long long> &f, outputBuffer &out);
+void writeBigResult(const char *text, size_t size, outputBuffer &out);
+void writeJob(const job &j, outputBuffer &out);
+const char *evaluateRange(const char *p, const char *end, outputBuffer &out, batchEvaluator *batch,
+                          resultCache *cache, bool binary);
+bool parseFormat(const char *name, bool &binary);
+int openInput(const char *path);
+int runStream(const char *path, bool simd, size_t cacheSize, bool binaryIn, bool binaryOut);
+void streamPipe(int fd, size_t blockSize, outputBuffer &out, batchEvaluator *batch, resultCache *cache,
+                bool binaryIn);
+int runParallel(const char *path, int threads, bool simd, size_t cacheSize, bool binaryIn, bool binaryOut);
+int runConvert(const char *path, const char *what, bool binaryIn, bool binaryOut);
+const char *convertResult(const char *p, const char *end, bool binaryIn, outputBuffer &out);
+void reportCache(const cacheStats &s);
+int runExpressions(const char *path);
+int runReduce(const char *path, const char *op, int threads);
+int runSort(const char *path);
+void sortFractions(vector<fraction<long long> > &values);
+size_t readInput(int fd, vector<char> &buf);
+void gcdLanes(const uint32_t *a, const uint32_t *b, uint32_t *g, size_t n);
+const char *simdLevel(void);
+void writeAll(int fd, const char *data, size_t size);
+void simpTrialDivision(int &numerator, int &denominator);
+int benchRow(const char *name, const vector<pair<int, int> > &inputs);
+int benchChains(const char *name, const vector<expression> &chains);
+int benchParse(const char *name, const vector<job> &jobs);
+int benchSort(const char *name, const vector<fraction<long long> > &values);
+int benchStream(const char *name, const vector<job> &jobs);
+template <typename Op> void benchOp(const char *name, size_t count, Op op);
+void benchOperations(const char *name, const vector<pair<long long, long long> > &operands);
+void runOperationBenchmark(mt19937 &rng);
+int runBenchmark(void);
+
+int main(int argc, char *argv[]) {
+    long long n1 = 0;
+    long long d1 = 0;
+    long long n2 = 0;
+    long long d2 = 0;
     string op;
     char junk;
+    const char *path = NULL;
+    bool stream = false;
+    bool simd = false;
+    bool expr = false;
+    bool sort = false;
+    const char *reduce = NULL;
+    const char *convert = NULL;
+    bool binaryIn = false;
+    bool binaryOut = false;
+    bool formatGiven = false;
+    int threads = 1;
+    size_t cacheSize = 0;
+
+    // parse options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0) {
+            return runBenchmark();      // microbenchmark mode
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[i], "--simd") == 0) {
+            simd = true;
+        } else if (strcmp(argv[i], "--expr") == 0) {
+            expr = true;
+        } else if (strcmp(argv[i], "--sort") == 0) {
+            sort = true;
+        } else if (strcmp(argv[i], "--reduce") == 0 && i + 1 < argc) {
+            reduce = argv[++i];
+            if (strcmp(reduce, "sum") != 0 && strcmp(reduce, "product") != 0) {
+                fprintf(stderr, "%s is not sum or product\n", reduce);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--convert") == 0 && i + 1 < argc) {
+            convert = argv[++i];
+            if (strcmp(convert, "jobs") != 0 && strcmp(convert, "results") != 0) {
+                fprintf(stderr, "%s is not jobs or results\n", convert);
+                return 1;
+            }
+        } else if ((strcmp(argv[i], "--in-format") == 0 || strcmp(argv[i], "--out-format") == 0) && i + 1 < argc) {
+            bool &binary = argv[i][2] == 'i' ? binaryIn : binaryOut;
+            if (!parseFormat(argv[++i], binary)) {
+                fprintf(stderr, "%s is not text or binary\n", argv[i]);
+                return 1;
+            }
+            formatGiven = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1) {
+                fprintf(stderr, "%s is not a valid thread count\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            long long n = atoll(argv[++i]);
+            if (n < 1) {
+                fprintf(stderr, "%s is not a valid cache size\n", argv[i]);
+                return 1;
+            }
+            cacheSize = (size_t)n;
+        } else if (argv[i][0] == '-' || path != NULL) {
+            fprintf(stderr, "usage: ./fractions [--stream] [--threads N] [--simd] [--cache N] [--expr] [--reduce sum|product] [--sort]\n"
+                            "                   [--convert jobs|results] [--in-format text|binary] [--out-format text|binary] [file]\n");
+            return 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    // rewrite records between text and binary
+    if (convert != NULL) {
+        return runConvert(path, convert, binaryIn, binaryOut);
+    }
+    if (formatGiven && (expr || reduce != NULL || sort)) {
+        fprintf(stderr, "--in-format and --out-format only apply to job files\n");
+        return 1;
+    }
+    // one expression per line
+    if (expr) {
+        return runExpressions(path);
+    }
+    // fold the whole input
+    if (reduce != NULL) {
+        return runReduce(path, reduce, threads);
+    }
+    // order the whole input
+    if (sort) {
+        return runSort(path);
+    }
+    // parallel batch mode
+    if (threads > 1) {
+        return runParallel(path, threads, simd, cacheSize, binaryIn, binaryOut);
+    }
+    // buffered streaming mode
+    if (stream || simd || cacheSize > 0 || formatGiven || path != NULL) {
+        return runStream(path, simd, cacheSize, binaryIn, binaryOut);
+    }
 
     // loop until end of file
     while (!cin.fail()) {
@@ -41,7 +415,7 @@ int main() {
         cin >> d1;
 
         if (!cin.fail()) {
-            fraction f1(n1, d1);
+            fraction<long long> f1(n1, d1);
 
             // define operator
             cin >> op;
@@ -50,18 +424,18 @@ int main() {
             cin >> n2;
             cin >> junk;        // fraction bar is junk character
             cin >> d2;
-            fraction f2(n2, d2);
+            fraction<long long> f2(n2, d2);
 
-            // apply desired operation to first fraction
+            // apply desired operation; the operators return reduced results
             if (op == "+") {
-                f1.add(f2);
+                f1 = f1 + f2;
             } else if (op == "*") {
-                f1.mult(f2);
+                f1 = f1 * f2;
             } else if (op == "div") {
-                f1.div(f2);
+                f1 = f1 / f2;
+            } else {
+                f1.simp();
             }
-            // simplify and display fraction
-            f1.simp();
             f1.display();
         }
     }
@@ -69,58 +443,2032 @@ int main() {
 }
 
 
-/* Constructs a fraction */
-fraction::fraction(int n, int d) {
-    this->numerator=n;
-    this->denominator=d;
+/* Allocates lane storage */
+fractionArray::fractionArray(void) {
+    numerators = NULL;
+    denominators = NULL;
+    fallback = NULL;
+    count = 0;
+    capacity = 0;
 }
 
 
-/* Displays a fraction */
-void fraction::display() {
-    cout << numerator << " / " << denominator << endl;
+fractionArray::~fractionArray(void) {
+    free(numerators);
+    free(denominators);
+    free(fallback);
 }
 
 
-/* Adds 2 fractions */
-void fraction::add(fraction f) {
-    numerator = (numerator * f.denominator) + (f.numerator * denominator);
-    denominator *= f.denominator;
+/* Grows the arrays to hold at least n lanes, in whole 32-byte vectors */
+void fractionArray::reserve(size_t n) {
+    if (n <= capacity) {
+        return;
+    }
+    size_t newCapacity = max((size_t)64, capacity * 2);
+    while (newCapacity < n) {
+        newCapacity *= 2;
+    }
+    int *newNumerators = (int *)aligned_alloc(32, newCapacity * sizeof(int));
+    int *newDenominators = (int *)aligned_alloc(32, newCapacity * sizeof(int));
+    uint8_t *newFallback = (uint8_t *)aligned_alloc(32, newCapacity);
+    if (count > 0) {
+        memcpy(newNumerators, numerators, count * sizeof(int));
+        memcpy(newDenominators, denominators, count * sizeof(int));
+        memcpy(newFallback, fallback, count);
+    }
+    free(numerators);
+    free(denominators);
+    free(fallback);
+    numerators = newNumerators;
+    denominators = newDenominators;
+    fallback = newFallback;
+    capacity = newCapacity;
+    scratch.resize(4 * capacity);
 }
 
 
-/* Multiplies 2 fractions */
-void fraction::mult(fraction f) {
-    numerator *= f.numerator;
-    denominator *= f.denominator;
+size_t fractionArray::push(int n, int d) {
+    reserve(count + 1);
+    numerators[count] = n;
+    denominators[count] = d;
+    fallback[count] = d == 0 || n == INT_MIN || d == INT_MIN;
+    return count++;
 }
 
 
-/* Divides 2 fractions */
-void fraction::div(fraction f) {
-    numerator *= f.denominator;
-    denominator *= f.numerator;
+/* |x| for every lane */
+SIMD_CLONES
+static void magnitudeLanes(const int *__restrict x, uint32_t *__restrict m, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        m[i] = x[i] < 0 ? 0u - (uint32_t)x[i] : (uint32_t)x[i];
+    }
 }
 
 
-/* Simplifies a fraction */
-void fraction::simp(void) {
-    int i = 2;
-    int end;
-    // find smaller of the 2 numbers
-    if (numerator > denominator) {
-        end = denominator;
+/* Exact quotient of a lane by a divisor of it. Both fit in a double's
+ * mantissa, so the division vectorizes and is exact.
+ */
+static inline long long divideLane(int x, uint32_t g) {
+    return (long long)((double)x / (double)g);
+}
+
+
+/* n1 / d1 += n2 / d2 over the LCM of the denominators; g holds their GCDs */
+SIMD_CLONES
+static void addLanes(int *__restrict n1, int *__restrict d1, const int *__restrict n2,
+                     const int *__restrict d2, const uint32_t *__restrict g,
+                     uint8_t *__restrict fallback, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t div = g[i] | (g[i] == 0);
+        long long scale = divideLane(d2[i], div);
+        long long numerator = (long long)n1[i] * scale + (long long)n2[i] * divideLane(d1[i], div);
+        long long denominator = (long long)d1[i] * scale;
+        fallback[i] |= numerator != (int)numerator || denominator != (int)denominator;
+        n1[i] = (int)numerator;
+        d1[i] = (int)denominator;
+    }
+}
+
+
+/* n1 / d1 *= n2 / d2, cancelling crosswise by g1 = gcd(n1, d2) and
+ * g2 = gcd(n2, d1) first
+ */
+SIMD_CLONES
+static void multLanes(int *__restrict n1, int *__restrict d1, const int *__restrict n2,
+                      const int *__restrict d2, const uint32_t *__restrict g1,
+                      const uint32_t *__restrict g2, uint8_t *__restrict fallback, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t div1 = g1[i] | (g1[i] == 0);
+        uint32_t div2 = g2[i] | (g2[i] == 0);
+        long long numerator = divideLane(n1[i], div1) * divideLane(n2[i], div2);
+        long long denominator = divideLane(d1[i], div2) * divideLane(d2[i], div1);
+        fallback[i] |= numerator != (int)numerator || denominator != (int)denominator ||
+                       denominator == 0;
+        n1[i] = (int)numerator;
+        d1[i] = (int)denominator;
+    }
+}
+
+
+/* Divides every lane by its GCD g and moves the sign to the numerator */
+SIMD_CLONES
+static void simpLanes(int *__restrict num, int *__restrict den, const uint32_t *__restrict g,
+                      uint8_t *__restrict fallback, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t div = g[i] | (g[i] == 0);
+        long long numerator = divideLane(num[i], div);
+        long long denominator = divideLane(den[i], div);
+        long long sign = denominator < 0 ? -1 : 1;
+        numerator *= sign;
+        denominator *= sign;
+        denominator = numerator == 0 ? 1 : denominator;
+        fallback[i] |= numerator != (int)numerator || denominator != (int)denominator ||
+                       denominator == 0;
+        num[i] = (int)numerator;
+        den[i] = (int)denominator;
+    }
+}
+
+
+void fractionArray::add(const fractionArray &f) {
+    uint32_t *m1 = scratchLanes(0);
+    uint32_t *m2 = scratchLanes(1);
+    uint32_t *g = scratchLanes(2);
+    magnitudeLanes(denominators, m1, count);
+    magnitudeLanes(f.denominators, m2, count);
+    gcdLanes(m1, m2, g, count);
+    for (size_t i = 0; i < count; i++) {
+        fallback[i] |= f.fallback[i];
+    }
+    addLanes(numerators, denominators, f.numerators, f.denominators, g, fallback, count);
+}
+
+
+void fractionArray::mult(const fractionArray &f) {
+    multiply(f.numerators, f.denominators, f.fallback);
+}
+
+
+/* Multiplies by the reciprocal, so a zero numerator in f falls back */
+void fractionArray::div(const fractionArray &f) {
+    multiply(f.denominators, f.numerators, f.fallback);
+}
+
+
+void fractionArray::multiply(const int *n2, const int *d2, const uint8_t *otherFallback) {
+    uint32_t *m1 = scratchLanes(0);
+    uint32_t *m2 = scratchLanes(1);
+    uint32_t *g1 = scratchLanes(2);
+    uint32_t *g2 = scratchLanes(3);
+    magnitudeLanes(numerators, m1, count);
+    magnitudeLanes(d2, m2, count);
+    gcdLanes(m1, m2, g1, count);
+    magnitudeLanes(n2, m1, count);
+    magnitudeLanes(denominators, m2, count);
+    gcdLanes(m1, m2, g2, count);
+    for (size_t i = 0; i < count; i++) {
+        fallback[i] |= otherFallback[i];
+    }
+    multLanes(numerators, denominators, n2, d2, g1, g2, fallback, count);
+}
+
+
+void fractionArray::simp(void) {
+    uint32_t *m1 = scratchLanes(0);
+    uint32_t *m2 = scratchLanes(1);
+    uint32_t *g = scratchLanes(2);
+    magnitudeLanes(numerators, m1, count);
+    magnitudeLanes(denominators, m2, count);
+    gcdLanes(m1, m2, g, count);
+    simpLanes(numerators, denominators, g, fallback, count);
+}
+
+
+/* Binary GCD of each lane pair, one lane at a time */
+static void gcdLanesScalar(const uint32_t *a, const uint32_t *b, uint32_t *g, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        g[i] = gcd(a[i], b[i]);
+    }
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Binary GCD of four lane pairs at a time. There is no vector ctz, so
+ * factors of two are removed one bit per step under a mask, and the shared
+ * ones are collected in scale and multiplied back at the end.
+ */
+__attribute__((target("sse4.1")))
+static void gcdLanesSse41(const uint32_t *a, const uint32_t *b, uint32_t *g, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i xZero = _mm_cmpeq_epi32(x, zero);
+        __m128i yZero = _mm_cmpeq_epi32(y, zero);
+        // gcd(0, y) = y and gcd(x, 0) = x, so run those lanes as 1, 1
+        __m128i anyZero = _mm_or_si128(xZero, yZero);
+        __m128i u = _mm_blendv_epi8(x, one, anyZero);
+        __m128i v = _mm_blendv_epi8(y, one, anyZero);
+        __m128i scale = one;
+        for (;;) {
+            __m128i even = _mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(u, v), one), zero);
+            if (_mm_testz_si128(even, even)) {
+                break;
+            }
+            u = _mm_blendv_epi8(u, _mm_srli_epi32(u, 1), even);
+            v = _mm_blendv_epi8(v, _mm_srli_epi32(v, 1), even);
+            scale = _mm_blendv_epi8(scale, _mm_add_epi32(scale, scale), even);
+        }
+        for (;;) {
+            __m128i even = _mm_cmpeq_epi32(_mm_and_si128(u, one), zero);
+            if (_mm_testz_si128(even, even)) {
+                break;
+            }
+            u = _mm_blendv_epi8(u, _mm_srli_epi32(u, 1), even);
+        }
+        // u stays odd: halve an even v, otherwise replace (u, v) by (min, max - min)
+        while (!_mm_testz_si128(v, v)) {
+            __m128i vEven = _mm_cmpeq_epi32(_mm_and_si128(v, one), zero);
+            __m128i low = _mm_min_epu32(u, v);
+            __m128i high = _mm_max_epu32(u, v);
+            u = _mm_blendv_epi8(low, u, vEven);
+            v = _mm_blendv_epi8(_mm_sub_epi32(high, low), _mm_srli_epi32(v, 1), vEven);
+        }
+        __m128i r = _mm_mullo_epi32(u, scale);
+        r = _mm_blendv_epi8(r, y, xZero);
+        r = _mm_blendv_epi8(r, x, yZero);
+        _mm_storeu_si128((__m128i *)(g + i), r);
+    }
+    gcdLanesScalar(a + i, b + i, g + i, n - i);
+}
+
+
+/* The same kernel eight lanes at a time */
+__attribute__((target("avx2")))
+static void gcdLanesAvx2(const uint32_t *a, const uint32_t *b, uint32_t *g, size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i xZero = _mm256_cmpeq_epi32(x, zero);
+        __m256i yZero = _mm256_cmpeq_epi32(y, zero);
+        __m256i anyZero = _mm256_or_si256(xZero, yZero);
+        __m256i u = _mm256_blendv_epi8(x, one, anyZero);
+        __m256i v = _mm256_blendv_epi8(y, one, anyZero);
+        __m256i scale = one;
+        for (;;) {
+            __m256i even = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_or_si256(u, v), one), zero);
+            if (_mm256_testz_si256(even, even)) {
+                break;
+            }
+            u = _mm256_blendv_epi8(u, _mm256_srli_epi32(u, 1), even);
+            v = _mm256_blendv_epi8(v, _mm256_srli_epi32(v, 1), even);
+            scale = _mm256_blendv_epi8(scale, _mm256_add_epi32(scale, scale), even);
+        }
+        for (;;) {
+            __m256i even = _mm256_cmpeq_epi32(_mm256_and_si256(u, one), zero);
+            if (_mm256_testz_si256(even, even)) {
+                break;
+            }
+            u = _mm256_blendv_epi8(u, _mm256_srli_epi32(u, 1), even);
+        }
+        while (!_mm256_testz_si256(v, v)) {
+            __m256i vEven = _mm256_cmpeq_epi32(_mm256_and_si256(v, one), zero);
+            __m256i low = _mm256_min_epu32(u, v);
+            __m256i high = _mm256_max_epu32(u, v);
+            u = _mm256_blendv_epi8(low, u, vEven);
+            v = _mm256_blendv_epi8(_mm256_sub_epi32(high, low), _mm256_srli_epi32(v, 1), vEven);
+        }
+        __m256i r = _mm256_mullo_epi32(u, scale);
+        r = _mm256_blendv_epi8(r, y, xZero);
+        r = _mm256_blendv_epi8(r, x, yZero);
+        _mm256_storeu_si256((__m256i *)(g + i), r);
+    }
+    gcdLanesScalar(a + i, b + i, g + i, n - i);
+}
+#endif
+
+
+typedef void (*gcdKernel)(const uint32_t *, const uint32_t *, uint32_t *, size_t);
+
+/* Picks the widest GCD kernel this CPU supports */
+static gcdKernel selectGcdKernel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        return gcdLanesAvx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return gcdLanesSse41;
+    }
+#endif
+    return gcdLanesScalar;
+}
+
+
+/* g[i] = gcd(a[i], b[i]) with the kernel chosen at startup */
+void gcdLanes(const uint32_t *a, const uint32_t *b, uint32_t *g, size_t n) {
+    static const gcdKernel kernel = selectGcdKernel();
+    kernel(a, b, g, n);
+}
+
+
+/* Name of the instruction set the lane kernels run with */
+const char *simdLevel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return "sse4.1";
+    }
+#endif
+    return "scalar";
+}
+
+
+/* Skips whitespace the way operator>> does */
+static const char *skipSpace(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f')) {
+        p++;
+    }
+    return p;
+}
+
+
+/* Parses an optionally signed decimal integer. Returns NULL if there is no
+ * number at p or it does not fit in a long long.
+ */
+static const char *scanInteger(const char *p, const char *end, long long &out) {
+    p = skipSpace(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return NULL;
+    }
+    unsigned long long m = 0;
+    unsigned long long limit = negative ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX;
+    while (p < end && *p >= '0' && *p <= '9') {
+        unsigned int digit = *p++ - '0';
+        if (m > (limit - digit) / 10) {
+            return NULL;
+        }
+        m = m * 10 + digit;
+    }
+    out = negative ? (long long)(0 - m) : (long long)m;
+    return p;
+}
+
+
+/* Parses one fraction: an integer, a bar character and an integer */
+static const char *scanFraction(const char *p, const char *end, long long &n, long long &d) {
+    p = scanInteger(p, end, n);
+    if (p == NULL) {
+        return NULL;
+    }
+    p = skipSpace(p, end);
+    if (p == end) {
+        return NULL;
+    }
+    p++;    // fraction bar is junk character
+    return scanInteger(p, end, d);
+}
+
+
+/* Parses "n / d op n / d" starting at p. Returns the position after the job,
+ * or NULL when the input ends before a whole job was read.
+ */
+const char *scanJob(const char *p, const char *end, job &j) {
+    p = scanFraction(p, end, j.n1, j.d1);
+    if (p == NULL) {
+        return NULL;
+    }
+    p = skipSpace(p, end);
+    const char *op = p;
+    while (p < end && *p != ' ' && *p != '\n' && *p != '\t' && *p != '\r') {
+        p++;
+    }
+    if (p - op == 1 && (*op == '+' || *op == '*')) {
+        j.op = *op;
+    } else if (p - op == 3 && memcmp(op, "div", 3) == 0) {
+        j.op = 'd';
     } else {
-        end = numerator;
+        j.op = '?';
     }
-    // iterate and repeatedly divide by the least common denominator
-    while (i <= end) {
-        if (numerator%i==0 && denominator%i==0) {
-            numerator /= i;
-            denominator /= i;
-            i = 2;
+    return scanFraction(p, end, j.n2, j.d2);
+}
+
+
+/* Appends v as a zigzag varint at p and returns the end */
+static char *writeVarint(char *p, long long v) {
+    unsigned long long z = ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+    while (z >= 0x80) {
+        *p++ = (char)(z | 0x80);
+        z >>= 7;
+    }
+    *p++ = (char)z;
+    return p;
+}
+
+
+/* Reads a zigzag varint. Returns NULL if the input ends inside it or it is
+ * longer than a long long allows.
+ */
+static const char *scanVarint(const char *p, const char *end, long long &out) {
+    unsigned long long z = 0;
+    for (unsigned int shift = 0; shift < 7 * maxVarintBytes; shift += 7) {
+        if (p == end) {
+            return NULL;
+        }
+        unsigned char b = (unsigned char)*p++;
+        z |= (unsigned long long)(b & 0x7f) << shift;
+        if (b < 0x80) {
+            out = (long long)(z >> 1) ^ -(long long)(z & 1);
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+/* Decodes one binary job record starting at p. Returns the position after
+ * it, or NULL when the input ends inside it or the op byte is not one of
+ * struct job's.
+ */
+const char *scanJobRecord(const char *p, const char *end, job &j) {
+    if (p == end || (*p != '+' && *p != '*' && *p != 'd' && *p != '?')) {
+        return NULL;
+    }
+    j.op = *p++;
+    long long *fields[4] = { &j.n1, &j.d1, &j.n2, &j.d2 };
+    for (int i = 0; i < 4 && p != NULL; i++) {
+        p = scanVarint(p, end, *fields[i]);
+    }
+    return p;
+}
+
+
+/* Steps over one binary job record without decoding it */
+const char *skipJobRecord(const char *p, const char *end) {
+    if (p == end) {
+        return NULL;
+    }
+    p++;
+    for (int fields = 0; fields < 4; p++) {
+        if (p == end) {
+            return NULL;
+        }
+        fields += (unsigned char)*p < 0x80;
+    }
+    return p;
+}
+
+
+/* Applies the operator, simplifies and appends "n / d\n" to the output,
+ * looking the job up in cache first if one is given
+ */
+void evaluateJob(const job &j, outputBuffer &out, resultCache *cache) {
+    long long n, d;
+    if (cache != NULL && cache->findJob(j, n, d)) {
+        writeFraction(fraction<long long>(n, d), out);
+        return;
+    }
+    computeJob(j, out, cache);
+}
+
+
+/* evaluateJob for a job already missed in cache: applies the operator,
+ * simplifies through cache and stores the result there
+ */
+void computeJob(const job &j, outputBuffer &out, resultCache *cache) {
+    fraction<long long> f1(j.n1, j.d1);
+    fraction<long long> f2(j.n2, j.d2);
+    if (j.op == '+') {
+        f1.add(f2);
+    } else if (j.op == '*') {
+        f1.mult(f2);
+    } else if (j.op == 'd') {
+        f1.div(f2);
+    }
+    if (cache != NULL) {
+        cache->simp(f1);
+        if (!f1.isPromoted()) {
+            cache->storeJob(j, f1.getNumerator(), f1.getDenominator());
+        }
+    } else {
+        f1.simp();
+    }
+    writeFraction(f1, out);
+}
+
+
+/* Appends "n / d\n", or a result record for a binary output */
+void writeFraction(const fraction<long long> &f, outputBuffer &out) {
+    if (f.isPromoted()) {
+        string s = f.toString();
+        writeBigResult(s.data(), s.size(), out);
+        return;
+    }
+    char *p = out.reserve(64);
+    if (out.isBinary()) {
+        *p++ = 'f';
+        p = writeVarint(p, f.getNumerator());
+        p = writeVarint(p, f.getDenominator());
+    } else {
+        p = writeInteger(p, f.getNumerator());
+        memcpy(p, " / ", 3);
+        p = writeInteger(p + 3, f.getDenominator());
+        *p++ = '\n';
+    }
+    out.commit(p);
+}
+
+
+/* Appends a promoted result given as "n / d" text */
+void writeBigResult(const char *text, size_t size, outputBuffer &out) {
+    if (out.isBinary()) {
+        char *p = out.reserve(1 + maxVarintBytes);
+        *p++ = 'b';
+        out.commit(writeVarint(p, (long long)size));
+        out.append(text, size);
+    } else {
+        out.append(text, size);
+        out.append("\n", 1);
+    }
+}
+
+
+/* Appends a job as a text line or a binary record */
+void writeJob(const job &j, outputBuffer &out) {
+    char *p = out.reserve(128);
+    if (out.isBinary()) {
+        *p++ = j.op;
+        p = writeVarint(p, j.n1);
+        p = writeVarint(p, j.d1);
+        p = writeVarint(p, j.n2);
+        p = writeVarint(p, j.d2);
+    } else {
+        const char *op = j.op == '+' ? "+" : j.op == '*' ? "*" : j.op == 'd' ? "div" : "?";
+        p = writeInteger(p, j.n1);
+        memcpy(p, " / ", 3);
+        p = writeInteger(p + 3, j.d1);
+        *p++ = ' ';
+        memcpy(p, op, strlen(op));
+        p += strlen(op);
+        *p++ = ' ';
+        p = writeInteger(p, j.n2);
+        memcpy(p, " / ", 3);
+        p = writeInteger(p + 3, j.d2);
+        *p++ = '\n';
+    }
+    out.commit(p);
+}
+
+
+/* Creates an output buffer of the given size for fd, or -1 for memory */
+outputBuffer::outputBuffer(int fd, size_t capacity, bool binary) {
+    this->fd = fd;
+    this->data.resize(capacity);
+    this->used = 0;
+    this->binary = binary;
+}
+
+
+outputBuffer::~outputBuffer(void) {
+    flush();
+}
+
+
+char *outputBuffer::reserve(size_t n) {
+    if (data.size() - used < n) {
+        if (fd >= 0) {
+            flush();
+        }
+        if (data.size() - used < n) {
+            data.resize(max(data.size() * 2, used + n));
+        }
+    }
+    return data.data() + used;
+}
+
+
+void outputBuffer::append(const char *s, size_t n) {
+    while (n > 0) {
+        if (used == data.size()) {
+            reserve(1);     // flushes to fd, or grows a memory buffer
+        }
+        size_t chunk = min(n, data.size() - used);
+        memcpy(data.data() + used, s, chunk);
+        used += chunk;
+        s += chunk;
+        n -= chunk;
+    }
+}
+
+
+/* Writes out everything buffered so far */
+void outputBuffer::flush(void) {
+    if (fd < 0) {
+        return;
+    }
+    writeAll(fd, data.data(), used);
+    used = 0;
+}
+
+
+/* Writes size bytes to fd, retrying short writes */
+void writeAll(int fd, const char *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, data + done, size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+}
+
+
+void outputBuffer::release(vector<char> &out) {
+    size_t capacity = data.size();
+    data.resize(used);
+    out.swap(data);
+    data.resize(capacity);
+    used = 0;
+}
+
+
+/* Evaluates every job in [p, end) into out, through batch if it is not
+ * NULL, reading binary records if binary is set. Returns where scanning
+ * stopped; anything but trailing whitespace there is not a job and ends the
+ * input like cin failing.
+ */
+const char *evaluateRange(const char *p, const char *end, outputBuffer &out, batchEvaluator *batch,
+                          resultCache *cache, bool binary) {
+    job j;
+    const char *next;
+    while ((next = binary ? scanJobRecord(p, end, j) : scanJob(p, end, j)) != NULL) {
+        if (batch != NULL) {
+            batch->push(j, cache);
+            if (batch->full()) {
+                batch->flush(out, cache);
+            }
         } else {
-            i++;
+            evaluateJob(j, out, cache);
         }
+        p = next;
+    }
+    if (batch != NULL) {
+        batch->flush(out, cache);
+    }
+    return p;
+}
+
+
+/* Queues a job on the batch for its operator, or for the scalar path if its
+ * operands do not fit the int lanes. A job for the lanes is looked up in
+ * cache first, if one is given; the scalar path looks its jobs up itself.
+ */
+void batchEvaluator::push(const job &j, resultCache *cache) {
+    slot s;
+    s.op = j.op == '+' ? 0 : j.op == '*' ? 1 : j.op == 'd' ? 2 : -1;
+    s.lane = 0;
+    const long long values[4] = { j.n1, j.d1, j.n2, j.d2 };
+    for (int i = 0; i < 4; i++) {
+        if (values[i] <= INT_MIN || values[i] > INT_MAX) {
+            s.op = -1;
+        }
+    }
+    if (s.op >= 0 && cache != NULL && cache->findJob(j, s.n, s.d)) {
+        s.op = -2;
+    }
+    if (s.op >= 0) {
+        s.lane = left[s.op].push((int)j.n1, (int)j.d1);
+        right[s.op].push((int)j.n2, (int)j.d2);
+    }
+    jobs.push_back(j);
+    slots.push_back(s);
+}
+
+
+/* Runs the kernels over every batch and writes the results in job order,
+ * storing the lanes' results in cache if one is given
+ */
+void batchEvaluator::flush(outputBuffer &out, resultCache *cache) {
+    if (left[0].size() > 0) {
+        left[0].add(right[0]);
+        left[0].simp();
+    }
+    if (left[1].size() > 0) {
+        left[1].mult(right[1]);
+        left[1].simp();
+    }
+    if (left[2].size() > 0) {
+        left[2].div(right[2]);
+        left[2].simp();
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const slot &s = slots[i];
+        if (s.op == -2) {
+            writeFraction(fraction<long long>(s.n, s.d), out);
+            continue;
+        }
+        if (s.op == -1) {
+            evaluateJob(jobs[i], out, cache);
+            continue;
+        }
+        if (left[s.op].needsFallback(s.lane)) {
+            computeJob(jobs[i], out, cache);      // push already missed in cache
+            continue;
+        }
+        long long n = left[s.op].getNumerator(s.lane);
+        long long d = left[s.op].getDenominator(s.lane);
+        if (cache != NULL) {
+            cache->storeJob(jobs[i], n, d);
+        }
+        writeFraction(fraction<long long>(n, d), out);
+    }
+    for (int k = 0; k < 3; k++) {
+        left[k].clear();
+        right[k].clear();
+    }
+    jobs.clear();
+    slots.clear();
+}
+
+
+/* Sizes both tables to the next power of two of at least capacity. A
+ * capacity of 0 leaves them empty; such a cache must not be used.
+ */
+resultCache::resultCache(size_t capacity) {
+    size_t size = 0;
+    if (capacity > 0) {
+        size = probeLimit;
+        while (size < capacity) {
+            size *= 2;
+        }
+    }
+    jobs.assign(size, jobEntry());
+    simps.assign(size, simpEntry());
+    mask = size - 1;
+    counters = cacheStats();
+}
+
+
+bool resultCache::findJob(const job &j, long long &n, long long &d) {
+    job key = normalize(j);
+    size_t home = hash(key.n1, key.d1, key.n2, key.d2, key.op);
+    for (size_t k = 0; k < probeLimit; k++) {
+        const jobEntry &e = jobs[(home + k) & mask];
+        if (e.op == 0) {
+            break;
+        }
+        if (e.op == key.op && e.n1 == key.n1 && e.d1 == key.d1 && e.n2 == key.n2 && e.d2 == key.d2) {
+            n = e.n;
+            d = e.d;
+            counters.jobHits++;
+            return true;
+        }
+    }
+    counters.jobMisses++;
+    return false;
+}
+
+
+void resultCache::storeJob(const job &j, long long n, long long d) {
+    job key = normalize(j);
+    size_t home = hash(key.n1, key.d1, key.n2, key.d2, key.op);
+    size_t slot = home & mask;
+    for (size_t k = 0; k < probeLimit; k++) {
+        if (jobs[(home + k) & mask].op == 0) {
+            slot = (home + k) & mask;
+            break;
+        }
+    }
+    jobEntry &e = jobs[slot];
+    e.n1 = key.n1;
+    e.d1 = key.d1;
+    e.n2 = key.n2;
+    e.d2 = key.d2;
+    e.op = key.op;
+    e.n = n;
+    e.d = d;
+}
+
+
+void resultCache::simp(fraction<long long> &f) {
+    if (f.isPromoted()) {
+        f.simp();
+        return;
+    }
+    long long n = f.getNumerator();
+    long long d = f.getDenominator();
+    size_t home = hash(n, d, 0, 0, 's');
+    size_t slot = home & mask;
+    for (size_t k = 0; k < probeLimit; k++) {
+        simpEntry &e = simps[(home + k) & mask];
+        if (!e.used) {
+            slot = (home + k) & mask;
+            break;
+        }
+        if (e.n == n && e.d == d) {
+            f = fraction<long long>(e.reducedN, e.reducedD);
+            counters.simpHits++;
+            return;
+        }
+    }
+    counters.simpMisses++;
+    f.simp();
+    if (f.isPromoted()) {
+        return;
+    }
+    simpEntry &e = simps[slot];
+    e.n = n;
+    e.d = d;
+    e.reducedN = f.getNumerator();
+    e.reducedD = f.getDenominator();
+    e.used = true;
+}
+
+
+/* Orders the operands of + and * and moves denominator signs into the
+ * numerators, so equal jobs written differently share an entry. Jobs with a
+ * zero denominator, or dividing by zero, are left alone, since the sign of
+ * their n / 0 output depends on how they were written. The second operand
+ * of an unknown operator is ignored.
+ */
+job resultCache::normalize(const job &j) {
+    job key = j;
+    if (key.op == '?') {
+        key.n2 = 0;
+        key.d2 = 0;
+    }
+    if (key.d1 == 0 || (key.op != '?' && key.d2 == 0) || (key.op == 'd' && key.n2 == 0)) {
+        return key;
+    }
+    if (key.d1 < 0 && key.d1 != LLONG_MIN && key.n1 != LLONG_MIN) {
+        key.n1 = -key.n1;
+        key.d1 = -key.d1;
+    }
+    if (key.d2 < 0 && key.d2 != LLONG_MIN && key.n2 != LLONG_MIN) {
+        key.n2 = -key.n2;
+        key.d2 = -key.d2;
+    }
+    if ((key.op == '+' || key.op == '*') &&
+        (key.n2 < key.n1 || (key.n2 == key.n1 && key.d2 < key.d1))) {
+        swap(key.n1, key.n2);
+        swap(key.d1, key.d2);
+    }
+    return key;
+}
+
+
+/* Mixes the key fields with multiply-xorshift rounds */
+size_t resultCache::hash(long long a, long long b, long long c, long long d, char op) {
+    uint64_t h = (uint64_t)op * 0x9e3779b97f4a7c15ULL;
+    const long long fields[4] = { a, b, c, d };
+    for (int i = 0; i < 4; i++) {
+        h ^= (uint64_t)fields[i];
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    }
+    h *= 0x94d049bb133111ebULL;
+    return (size_t)(h ^ (h >> 29));
+}
+
+
+/* Prints the hit rates of both cache tables to stderr */
+void reportCache(const cacheStats &s) {
+    unsigned long long jobs = s.jobHits + s.jobMisses;
+    unsigned long long simps = s.simpHits + s.simpMisses;
+    fprintf(stderr, "cache: jobs %llu hits, %llu misses (%.1f%%); simp %llu hits, %llu misses (%.1f%%)\n",
+            s.jobHits, s.jobMisses, jobs > 0 ? 100.0 * s.jobHits / jobs : 0.0,
+            s.simpHits, s.simpMisses, simps > 0 ? 100.0 * s.simpHits / simps : 0.0);
+}
+
+
+/* Sets binary from a format name. Returns false unless it is text or binary. */
+bool parseFormat(const char *name, bool &binary) {
+    if (strcmp(name, "text") != 0 && strcmp(name, "binary") != 0) {
+        return false;
+    }
+    binary = strcmp(name, "binary") == 0;
+    return true;
+}
+
+
+/* Opens path, or returns stdin for NULL. Returns -1 if it cannot be read. */
+int openInput(const char *path) {
+    if (path == NULL) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s is not a readable file\n", path);
+    }
+    return fd;
+}
+
+
+/* Streaming mode: maps the input file (or stdin, if it is a regular file)
+ * and otherwise reads it through a large buffer. Jobs are scanned without
+ * allocating and results are written in blocks.
+ */
+int runStream(const char *path, bool simd, size_t cacheSize, bool binaryIn, bool binaryOut) {
+    const size_t blockSize = 1 << 20;
+    int fd = openInput(path);
+    if (fd < 0) {
+        return 1;
+    }
+    outputBuffer out(1, blockSize, binaryOut);
+    batchEvaluator batch;
+    batchEvaluator *batchPtr = simd ? &batch : NULL;
+    resultCache cache(cacheSize);
+    resultCache *cachePtr = cacheSize > 0 ? &cache : NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            const char *p = (const char *)map;
+            evaluateRange(p, p + st.st_size, out, batchPtr, cachePtr, binaryIn);
+            munmap(map, st.st_size);
+            if (fd != 0) {
+                close(fd);
+            }
+            if (cachePtr != NULL) {
+                reportCache(cache.stats());
+            }
+            return 0;
+        }
+    }
+
+    streamPipe(fd, blockSize, out, batchPtr, cachePtr, binaryIn);
+    if (fd != 0) {
+        close(fd);
+    }
+    if (cachePtr != NULL) {
+        reportCache(cache.stats());
+    }
+    return 0;
+}
+
+
+/* Evaluates the jobs read from a pipe or terminal, refilling a buffer of at
+ * least blockSize bytes and carrying over any partial job. Stops at the end
+ * of the input or at anything that is not a job.
+ */
+void streamPipe(int fd, size_t blockSize, outputBuffer &out, batchEvaluator *batch, resultCache *cache,
+                bool binaryIn) {
+    vector<char> buf(blockSize);
+    size_t filled = 0;
+    bool eof = false;
+    while (!eof) {
+        ssize_t n = read(fd, buf.data() + filled, buf.size() - filled);
+        if (n <= 0) {
+            eof = true;
+        } else {
+            filled += n;
+        }
+        const char *p = buf.data();
+        const char *end = p + filled;
+        // a text job may only be cut off by the end of the buffer, so stop
+        // one line short of it until the input is exhausted; a cut-off
+        // record just fails to decode
+        const char *safeEnd = end;
+        if (!eof && !binaryIn) {
+            while (safeEnd > p && safeEnd[-1] != '\n') {
+                safeEnd--;
+            }
+        }
+        p = evaluateRange(p, safeEnd, out, batch, cache, binaryIn);
+        if (binaryIn && (size_t)(end - p) >= maxJobRecordBytes) {
+            break;      // a whole record's worth of bytes that is not a record
+        }
+        if (!binaryIn && skipSpace(p, safeEnd) != safeEnd) {
+            break;      // stopped on a complete line that is not a job
+        }
+        filled = end - p;
+        memmove(buf.data(), p, filled);
+        if (filled == buf.size()) {
+            buf.resize(buf.size() * 2);     // a single job longer than the buffer
+        }
+    }
+}
+
+
+/* Parallel batch mode. The input is mapped (or read whole from a pipe), cut
+ * into line-aligned chunks and evaluated by a pool of workers, each with its
+ * own output buffer. Chunks are dealt round-robin and a worker whose queue
+ * runs dry steals from the back of another's. The main thread writes each
+ * chunk as soon as it and every chunk before it are done, so the output is
+ * in input order.
+ */
+int runParallel(const char *path, int threads, bool simd, size_t cacheSize, bool binaryIn, bool binaryOut) {
+    int fd = openInput(path);
+    if (fd < 0) {
+        return 1;
+    }
+    const char *data;
+    size_t size;
+    void *map = MAP_FAILED;
+    vector<char> buf;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (map != MAP_FAILED) {
+        data = (const char *)map;
+        size = st.st_size;
+    } else {
+        size = readInput(fd, buf);
+        data = buf.data();
+    }
+
+    // several chunks per thread so that stealing can even out slow ones
+    vector<chunk> chunks;
+    size_t target = max((size_t)1 << 16, size / (threads * 16));
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end) {
+        const char *stop = p;
+        if (binaryIn) {
+            // records can only be found by stepping over the ones before
+            while (stop < end && (size_t)(stop - p) < target) {
+                const char *next = skipJobRecord(stop, end);
+                stop = next != NULL ? next : end;   // trailing bytes that fail to decode
+            }
+        } else {
+            stop = p + min(target, (size_t)(end - p));
+            while (stop < end && stop[-1] != '\n') {
+                stop++;
+            }
+        }
+        chunk c;
+        c.begin = p;
+        c.end = stop;
+        c.stopped = false;
+        c.done = false;
+        chunks.push_back(c);
+        p = stop;
+    }
+    vector<workQueue> queues(threads);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        queues[i % threads].chunks.push_back(i);
+    }
+
+    mutex doneLock;
+    condition_variable doneSignal;
+    bool cancelled = false;     // a malformed job ended the input early
+    // one cache per worker, so lookups need no locking
+    vector<resultCache> caches(cacheSize > 0 ? threads : 0, resultCache(cacheSize));
+    auto worker = [&](int id) {
+        outputBuffer out(-1, 1 << 16, binaryOut);
+        batchEvaluator batch;
+        resultCache *cache = cacheSize > 0 ? &caches[id] : NULL;
+        for (;;) {
+            size_t c = 0;
+            bool found = false;
+            {
+                lock_guard<mutex> guard(queues[id].lock);
+                if (!queues[id].chunks.empty()) {
+                    c = queues[id].chunks.front();
+                    queues[id].chunks.pop_front();
+                    found = true;
+                }
+            }
+            for (int k = 1; !found && k < threads; k++) {
+                workQueue &victim = queues[(id + k) % threads];
+                lock_guard<mutex> guard(victim.lock);
+                if (!victim.chunks.empty()) {
+                    c = victim.chunks.back();
+                    victim.chunks.pop_back();
+                    found = true;
+                }
+            }
+            if (!found) {
+                return;
+            }
+            {
+                lock_guard<mutex> guard(doneLock);
+                if (cancelled) {
+                    return;
+                }
+            }
+            const char *stop = evaluateRange(chunks[c].begin, chunks[c].end, out, simd ? &batch : NULL, cache,
+                                             binaryIn);
+            bool complete = binaryIn ? stop == chunks[c].end : skipSpace(stop, chunks[c].end) == chunks[c].end;
+            out.release(chunks[c].output);
+            {
+                lock_guard<mutex> guard(doneLock);
+                chunks[c].stopped = !complete;
+                chunks[c].done = true;
+            }
+            doneSignal.notify_all();
+        }
+    };
+    vector<thread> pool;
+    for (int i = 0; i < threads; i++) {
+        pool.push_back(thread(worker, i));
+    }
+
+    // write results in input order
+    for (size_t i = 0; i < chunks.size(); i++) {
+        bool stopped;
+        {
+            unique_lock<mutex> guard(doneLock);
+            doneSignal.wait(guard, [&] { return chunks[i].done; });
+            stopped = chunks[i].stopped;
+            cancelled = stopped;
+        }
+        writeAll(1, chunks[i].output.data(), chunks[i].output.size());
+        vector<char>().swap(chunks[i].output);
+        if (stopped) {
+            break;
+        }
+    }
+    for (size_t i = 0; i < pool.size(); i++) {
+        pool[i].join();
+    }
+    if (cacheSize > 0) {
+        cacheStats total = {};
+        for (size_t i = 0; i < caches.size(); i++) {
+            total.jobHits += caches[i].stats().jobHits;
+            total.jobMisses += caches[i].stats().jobMisses;
+            total.simpHits += caches[i].stats().simpHits;
+            total.simpMisses += caches[i].stats().simpMisses;
+        }
+        reportCache(total);
+    }
+
+    if (map != MAP_FAILED) {
+        munmap(map, size);
+    }
+    if (fd != 0) {
+        close(fd);
+    }
+    return 0;
+}
+
+
+/* Parses one expression from p up to end. Returns false on a syntax error
+ * or parentheses nested deeper than maxExpressionDepth.
+ */
+bool expression::parse(const char *p, const char *end) {
+    nodes.clear();
+    depth = 0;
+    p = parseSum(p, end, root);
+    return p != NULL && skipSpace(p, end) == end;
+}
+
+
+/* sum: product, then any number of "+ product" or "- product" */
+const char *expression::parseSum(const char *p, const char *end, int &out) {
+    p = parseProduct(p, end, out);
+    while (p != NULL) {
+        p = skipSpace(p, end);
+        if (p == end || (*p != '+' && *p != '-')) {
+            break;
+        }
+        // an operand may carry its own sign, so "1/2 - -1/3" is a subtraction
+        node n = { *p, 0, 0, out, -1, -1 };
+        p = parseProduct(p + 1, end, n.right);
+        nodes.push_back(n);
+        out = (int)nodes.size() - 1;
+        nodes[n.left].up = out;
+    }
+    return p;
+}
+
+
+/* product: operand, then any number of "* operand" or "div operand" */
+const char *expression::parseProduct(const char *p, const char *end, int &out) {
+    p = parseOperand(p, end, out);
+    while (p != NULL) {
+        p = skipSpace(p, end);
+        char op;
+        if (p < end && *p == '*') {
+            op = '*';
+            p++;
+        } else if (end - p >= 3 && memcmp(p, "div", 3) == 0) {
+            op = 'd';
+            p += 3;
+        } else {
+            break;
+        }
+        node n = { op, 0, 0, out, -1, -1 };
+        p = parseOperand(p, end, n.right);
+        nodes.push_back(n);
+        out = (int)nodes.size() - 1;
+        nodes[n.left].up = out;
+    }
+    return p;
+}
+
+
+/* operand: "n / d" or a parenthesized sum, at most maxExpressionDepth deep */
+const char *expression::parseOperand(const char *p, const char *end, int &out) {
+    p = skipSpace(p, end);
+    if (p < end && *p == '(') {
+        if (++depth > maxExpressionDepth) {
+            return NULL;
+        }
+        p = parseSum(p + 1, end, out);
+        if (p == NULL) {
+            return NULL;
+        }
+        depth--;
+        p = skipSpace(p, end);
+        return p < end && *p == ')' ? p + 1 : NULL;
+    }
+    node n = { 'n', 0, 0, -1, -1, -1 };
+    p = scanInteger(p, end, n.n);
+    if (p == NULL) {
+        return NULL;
+    }
+    p = skipSpace(p, end);
+    if (p == end || *p != '/') {
+        return NULL;
+    }
+    p = scanInteger(p + 1, end, n.d);
+    nodes.push_back(n);
+    out = (int)nodes.size() - 1;
+    return p;
+}
+
+
+fraction<long long> expression::evaluate(void) const {
+    fraction<long long> f = evaluateNode(root, false);
+    f.simp();
+    return f;
+}
+
+
+fraction<long long> expression::evaluateEager(void) const {
+    return evaluateNode(root, true);
+}
+
+
+/* Evaluates a subtree. add/sub/mult/div only reduce when the exact result
+ * does not fit, so a chain of them costs one GCD per overflow instead of
+ * one per step. A chain is a run of left operands, however long, so it is
+ * folded in a loop from its first leaf up; only right operands recurse, as
+ * deep as the parentheses go.
+ */
+fraction<long long> expression::evaluateNode(int i, bool eager) const {
+    int k = i;
+    while (nodes[k].op != 'n') {
+        k = nodes[k].left;
+    }
+    fraction<long long> f(nodes[k].n, nodes[k].d);
+    if (eager) {
+        f.simp();
+    }
+    while (k != i) {
+        k = nodes[k].up;
+        const node &e = nodes[k];
+        fraction<long long> g = evaluateNode(e.right, eager);
+        if (e.op == '+') {
+            f.add(g);
+        } else if (e.op == '-') {
+            f.sub(g);
+        } else if (e.op == '*') {
+            f.mult(g);
+        } else {
+            f.div(g);
+        }
+        // a promoted intermediate is reduced right away, which demotes it if it fits
+        if (eager || f.isPromoted()) {
+            f.simp();
+        }
+    }
+    return f;
+}
+
+
+/* Expression mode: reads the whole input and prints the reduced value of
+ * each non-blank line. A line that does not parse is reported on stderr
+ * and skipped.
+ */
+int runExpressions(const char *path) {
+    int fd = openInput(path);
+    if (fd < 0) {
+        return 1;
+    }
+    vector<char> buf;
+    size_t filled = readInput(fd, buf);
+    if (fd != 0) {
+        close(fd);
+    }
+
+    outputBuffer out(1, 1 << 20);
+    expression e;
+    int status = 0;
+    size_t lineNumber = 0;
+    const char *p = buf.data();
+    const char *end = p + filled;
+    while (p < end) {
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        lineNumber++;
+        if (skipSpace(p, eol) != eol) {
+            if (e.parse(p, eol)) {
+                writeFraction(e.evaluate(), out);
+            } else {
+                fprintf(stderr, "line %zu: cannot parse expression\n", lineNumber);
+                status = 1;
+            }
+        }
+        p = eol + 1;
+    }
+    return status;
+}
+
+
+/* Reduce mode: reads every "n / d" in the input and prints their sum or
+ * product, folded with the tree reduction on the given number of threads
+ */
+int runReduce(const char *path, const char *op, int threads) {
+    int fd = openInput(path);
+    if (fd < 0) {
+        return 1;
+    }
+    vector<char> buf;
+    size_t filled = readInput(fd, buf);
+    if (fd != 0) {
+        close(fd);
+    }
+
+    vector<fraction<long long> > values;
+    const char *p = buf.data();
+    const char *end = p + filled;
+    while (skipSpace(p, end) != end) {
+        long long n, d;
+        p = scanFraction(p, end, n, d);
+        if (p == NULL) {
+            fprintf(stderr, "fraction %zu is malformed\n", values.size() + 1);
+            return 1;
+        }
+        values.push_back(fraction<long long>(n, d));
+    }
+
+    fraction<long long> result = strcmp(op, "sum") == 0 ? sum(values.begin(), values.end(), threads)
+                                                        : product(values.begin(), values.end(), threads);
+    outputBuffer out(1, 1 << 10);
+    writeFraction(result, out);
+    return 0;
+}
+
+
+/* Sort mode: reads every "n / d" in the input and prints them reduced, in
+ * ascending order. 0 / 0 has no place in the order and goes last.
+ */
+int runSort(const char *path) {
+    int fd = openInput(path);
+    if (fd < 0) {
+        return 1;
+    }
+    vector<char> buf;
+    size_t filled = readInput(fd, buf);
+    if (fd != 0) {
+        close(fd);
+    }
+
+    vector<fraction<long long> > values;
+    size_t undefined = 0;
+    const char *p = buf.data();
+    const char *end = p + filled;
+    while (skipSpace(p, end) != end) {
+        long long n, d;
+        p = scanFraction(p, end, n, d);
+        if (p == NULL) {
+            fprintf(stderr, "fraction %zu is malformed\n", values.size() + undefined + 1);
+            return 1;
+        }
+        if (n == 0 && d == 0) {
+            undefined++;
+            continue;
+        }
+        values.push_back(fraction<long long>(n, d));
+        values.back().simp();
+    }
+
+    sortFractions(values);
+    outputBuffer out(1, 1 << 20);
+    for (size_t i = 0; i < values.size(); i++) {
+        writeFraction(values[i], out);
+    }
+    for (size_t i = 0; i < undefined; i++) {
+        writeFraction(fraction<long long>(0, 0), out);
+    }
+    return 0;
+}
+
+
+/* Sorts reduced fractions, none of them 0 / 0, in ascending order. Each
+ * gets a key from n / d divided in long double: n and d convert to it
+ * exactly, so the quotient rounds once, and rounding is monotone, so the
+ * key never orders two fractions the wrong way round. The key is the
+ * quotient's sign and exponent over its full 64-bit mantissa, two radix
+ * words, which keeps runs of equal keys short even for values very close
+ * together. The keys are radix sorted, and runs of equal keys are then
+ * ordered by exact comparison. Equal values keep their input order.
+ */
+void sortFractions(vector<fraction<long long> > &values) {
+    if (numeric_limits<long double>::digits < 64) {
+        // n and d would not be exact in a long double, so the key could misorder close values
+        stable_sort(values.begin(), values.end());
+        return;
+    }
+    const int digitBits = 11;
+    const size_t buckets = (size_t)1 << digitBits;
+    size_t n = values.size();
+    vector<sortKey> keys(n), sorted(n);
+    for (size_t i = 0; i < n; i++) {
+        long double q = (long double)values[i].getNumerator() / values[i].getDenominator();
+        uint64_t mantissa;
+        uint32_t signExponent;      // sign bit over a 15-bit biased exponent, as x87 stores it
+#if (defined(__x86_64__) || defined(__i386__)) && __LDBL_MANT_DIG__ == 64
+        uint16_t top;
+        memcpy(&mantissa, &q, sizeof(mantissa));
+        memcpy(&top, (const char *)&q + sizeof(mantissa), sizeof(top));
+        signExponent = top;
+#else
+        // m is in [1/2, 1), so the mantissa has its top bit set; a wider
+        // long double is cut to 64 bits, which still rounds monotonically
+        int exponent = 0;
+        long double m = frexpl(fabsl(q), &exponent);
+        mantissa = q == 0 ? 0 : (uint64_t)ldexpl(m, 64);
+        signExponent = (q == 0 ? 0 : 16382 + exponent) | (q < 0 ? 0x8000 : 0);
+#endif
+        // flip negatives and set the sign of positives, so the bits order as the values do
+        bool negative = (signExponent & 0x8000) != 0;
+        keys[i].low = negative ? ~mantissa : mantissa;
+        keys[i].high = negative ? ~signExponent & 0xffff : signExponent | 0x8000;
+        keys[i].index = (uint32_t)i;
+    }
+
+    // least significant digit first, through the mantissa and on into the
+    // exponent; a digit every key shares costs no pass
+    vector<size_t> offsets(buckets);
+    for (int shift = 0; shift < 80; shift += digitBits) {
+        auto digit = [shift](const sortKey &k) {
+            unsigned __int128 whole = ((unsigned __int128)k.high << 64) | k.low;
+            return (size_t)(whole >> shift) & (buckets - 1);
+        };
+        fill(offsets.begin(), offsets.end(), 0);
+        for (size_t i = 0; i < n; i++) {
+            offsets[digit(keys[i])]++;
+        }
+        if (n == 0 || offsets[digit(keys[0])] == n) {
+            continue;
+        }
+        size_t total = 0;
+        for (size_t b = 0; b < buckets; b++) {
+            size_t count = offsets[b];
+            offsets[b] = total;
+            total += count;
+        }
+        for (size_t i = 0; i < n; i++) {
+            sorted[offsets[digit(keys[i])]++] = keys[i];
+        }
+        keys.swap(sorted);
+    }
+
+    vector<fraction<long long> > ordered;
+    ordered.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        ordered.push_back(move(values[keys[i].index]));
+    }
+    for (size_t run = 0; run < n; ) {
+        size_t stop = run + 1;
+        while (stop < n && keys[stop].low == keys[run].low && keys[stop].high == keys[run].high) {
+            stop++;
+        }
+        if (stop - run > 1) {
+            stable_sort(ordered.begin() + run, ordered.begin() + stop);
+        }
+        run = stop;
+    }
+    values.swap(ordered);
+}
+
+
+/* Convert mode: rewrites every job, or every result, from the input format
+ * into the output format without evaluating anything
+ */
+int runConvert(const char *path, const char *what, bool binaryIn, bool binaryOut) {
+    int fd = openInput(path);
+    if (fd < 0) {
+        return 1;
+    }
+    vector<char> buf;
+    size_t filled = readInput(fd, buf);
+    if (fd != 0) {
+        close(fd);
+    }
+
+    bool jobs = strcmp(what, "jobs") == 0;
+    outputBuffer out(1, 1 << 20, binaryOut);
+    size_t count = 0;
+    const char *p = buf.data();
+    const char *end = p + filled;
+    while (binaryIn ? p != end : skipSpace(p, end) != end) {
+        const char *next;
+        if (jobs) {
+            job j;
+            next = binaryIn ? scanJobRecord(p, end, j) : scanJob(p, end, j);
+            if (next != NULL) {
+                writeJob(j, out);
+            }
+        } else {
+            next = convertResult(p, end, binaryIn, out);
+        }
+        count++;
+        if (next == NULL) {
+            fprintf(stderr, "%s %zu is malformed\n", jobs ? "job" : "result", count);
+            return 1;
+        }
+        p = next;
+    }
+    return 0;
+}
+
+
+/* Skips an optionally negative run of digits of any length. Returns NULL if
+ * there is none at p.
+ */
+static const char *skipDecimal(const char *p, const char *end) {
+    p = skipSpace(p, end);
+    if (p < end && *p == '-') {
+        p++;
+    }
+    const char *digits = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        p++;
+    }
+    return p == digits ? NULL : p;
+}
+
+
+/* Reads one result, a text line or a binary record, and writes it to out.
+ * A text result too large for a long long is kept as text in a 'b' record.
+ * Returns the position after it, or NULL if it is malformed.
+ */
+const char *convertResult(const char *p, const char *end, bool binaryIn, outputBuffer &out) {
+    long long n, d;
+    if (binaryIn) {
+        if (*p == 'f') {
+            p = scanVarint(p + 1, end, n);
+            p = p != NULL ? scanVarint(p, end, d) : NULL;
+            if (p != NULL) {
+                writeFraction(fraction<long long>(n, d), out);
+            }
+            return p;
+        }
+        if (*p != 'b' || (p = scanVarint(p + 1, end, n)) == NULL || n < 0 || n > end - p) {
+            return NULL;
+        }
+        writeBigResult(p, (size_t)n, out);
+        return p + n;
+    }
+
+    p = skipSpace(p, end);
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if (eol == NULL) {
+        eol = end;
+    }
+    const char *stop = scanFraction(p, eol, n, d);
+    if (stop != NULL && skipSpace(stop, eol) == eol) {
+        writeFraction(fraction<long long>(n, d), out);
+        return eol;
+    }
+    stop = skipDecimal(p, eol);
+    if (stop == NULL || (stop = skipSpace(stop, eol)) == eol || *stop != '/' ||
+        (stop = skipDecimal(stop + 1, eol)) == NULL || skipSpace(stop, eol) != eol) {
+        return NULL;
+    }
+    writeBigResult(p, stop - p, out);
+    return eol;
+}
+
+
+/* Reads fd to the end into buf and returns the number of bytes read */
+size_t readInput(int fd, vector<char> &buf) {
+    size_t filled = 0;
+    ssize_t n;
+    buf.resize(1 << 20);
+    while ((n = read(fd, buf.data() + filled, buf.size() - filled)) > 0) {
+        filled += n;
+        if (filled == buf.size()) {
+            buf.resize(buf.size() * 2);
+        }
+    }
+    return filled;
+}
+
+
+/* The original reduction loop, kept as the benchmark baseline.
+ * Only reduces positive fractions.
+ */
+void simpTrialDivision(int &numerator, int &denominator) {
+    int i = 2;
+    int end;
+    // find smaller of the 2 numbers
+    if (numerator > denominator) {
+        end = denominator;
+    } else {
+        end = numerator;
+    }
+    // iterate and repeatedly divide by the least common denominator
+    while (i <= end) {
+        if (numerator%i==0 && denominator%i==0) {
+            numerator /= i;
+            denominator /= i;
+            i = 2;
+        } else {
+            i++;
+        }
+    }
+}
+
+
+/* Times both reductions over one set of inputs and prints a table row.
+ * Returns 1 if the two reductions disagree on any input.
+ */
+int benchRow(const char *name, const vector<pair<int, int> > &inputs) {
+    volatile int sink = 0;
+    int mismatches = 0;
+    vector<pair<int, int> > reduced(inputs);
+
+    auto start = chrono::steady_clock::now();
+    for (auto &r : reduced) {
+        simpTrialDivision(r.first, r.second);
+    }
+    double trialNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (const auto &in : inputs) {
+        fraction<int> f(in.first, in.second);
+        f.simp();
+        sink = sink + f.getNumerator() + f.getDenominator();
+    }
+    double gcdNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        fraction<int> f(inputs[i].first, inputs[i].second);
+        f.simp();
+        if (f.getNumerator() != reduced[i].first || f.getDenominator() != reduced[i].second) {
+            mismatches++;
+        }
+    }
+
+    double count = (double)inputs.size();
+    printf("%-12s %8zu %14.1f %14.1f %9.1fx\n", name, inputs.size(),
+           trialNs / count, gcdNs / count, trialNs / gcdNs);
+    return mismatches > 0;
+}
+
+
+/* Times eager and deferred reduction over the same expressions and checks
+ * that they agree. Returns nonzero on a mismatch.
+ */
+int benchChains(const char *name, const vector<expression> &chains) {
+    volatile long long sink = 0;
+    int mismatches = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (const auto &e : chains) {
+        fraction<long long> f = e.evaluateEager();
+        sink = sink + f.getNumerator();
+    }
+    double eagerNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (const auto &e : chains) {
+        fraction<long long> f = e.evaluate();
+        sink = sink + f.getNumerator();
+    }
+    double lazyNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+
+    for (const auto &e : chains) {
+        if (e.evaluate() != e.evaluateEager()) {
+            mismatches++;
+        }
+    }
+
+    double count = (double)chains.size();
+    printf("%-12s %8zu %14.1f %14.1f %9.1fx\n", name, chains.size(),
+           eagerNs / count, lazyNs / count, eagerNs / lazyNs);
+    return mismatches > 0;
+}
+
+
+/* Times decoding the same jobs from text and from binary records and checks
+ * that both decode them the same. Returns nonzero on a mismatch.
+ */
+int benchParse(const char *name, const vector<job> &jobs) {
+    outputBuffer text(-1, 1 << 20);
+    outputBuffer binary(-1, 1 << 20, true);
+    for (const auto &j : jobs) {
+        writeJob(j, text);
+        writeJob(j, binary);
+    }
+    vector<char> textBytes, binaryBytes;
+    text.release(textBytes);
+    binary.release(binaryBytes);
+    vector<job> fromText(jobs.size()), fromBinary(jobs.size());
+
+    auto start = chrono::steady_clock::now();
+    const char *p = textBytes.data();
+    for (size_t i = 0; i < jobs.size(); i++) {
+        p = scanJob(p, textBytes.data() + textBytes.size(), fromText[i]);
+    }
+    double textNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    p = binaryBytes.data();
+    for (size_t i = 0; i < jobs.size(); i++) {
+        p = scanJobRecord(p, binaryBytes.data() + binaryBytes.size(), fromBinary[i]);
+    }
+    double binaryNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+
+    int mismatches = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const job &a = fromText[i];
+        const job &b = fromBinary[i];
+        if (a.op != b.op || a.n1 != b.n1 || a.d1 != b.d1 || a.n2 != b.n2 || a.d2 != b.d2) {
+            mismatches++;
+        }
+    }
+
+    double count = (double)jobs.size();
+    printf("%-12s %8zu %14.1f %14.1f %9.1fx\n", name, jobs.size(),
+           textNs / count, binaryNs / count, textNs / binaryNs);
+    return mismatches > 0;
+}
+
+
+/* Evaluates the same jobs from memory and from a pipe written in pieces that
+ * cut lines in two, so the reader refills many times, and checks that both
+ * give the same results. Returns nonzero on a mismatch.
+ */
+int benchStream(const char *name, const vector<job> &jobs) {
+    outputBuffer text(-1, 1 << 20);
+    for (const auto &j : jobs) {
+        writeJob(j, text);
+    }
+    vector<char> input;
+    text.release(input);
+
+    outputBuffer mapped(-1, 1 << 20);
+    auto start = chrono::steady_clock::now();
+    evaluateRange(input.data(), input.data() + input.size(), mapped, NULL, NULL, false);
+    double mappedNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 1;
+    }
+    thread writer([&]() {
+        for (size_t done = 0; done < input.size(); done += 4093) {
+            writeAll(fds[1], input.data() + done, min(input.size() - done, (size_t)4093));
+        }
+        close(fds[1]);
+    });
+    outputBuffer piped(-1, 1 << 20);
+    start = chrono::steady_clock::now();
+    streamPipe(fds[0], 1 << 16, piped, NULL, NULL, false);
+    double pipedNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    char rest[4096];
+    while (read(fds[0], rest, sizeof(rest)) > 0) {
+        // a reader that stopped early must not leave the writer blocked
+    }
+    writer.join();
+    close(fds[0]);
+
+    vector<char> fromMapped, fromPiped;
+    mapped.release(fromMapped);
+    piped.release(fromPiped);
+    double count = (double)jobs.size();
+    printf("%-12s %8zu %14.1f %14.1f %9.1fx\n", name, jobs.size(),
+           pipedNs / count, mappedNs / count, pipedNs / mappedNs);
+    return fromMapped != fromPiped;
+}
+
+
+/* Times std::stable_sort with exact comparisons against sortFractions over
+ * the same values and checks that they agree. Returns nonzero on a mismatch.
+ */
+int benchSort(const char *name, const vector<fraction<long long> > &values) {
+    vector<fraction<long long> > compared(values), keyed(values);
+
+    auto start = chrono::steady_clock::now();
+    stable_sort(compared.begin(), compared.end());
+    double compareNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    sortFractions(keyed);
+    double keyedNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+
+    int mismatches = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+        if (compared[i].getNumerator() != keyed[i].getNumerator() ||
+            compared[i].getDenominator() != keyed[i].getDenominator()) {
+            mismatches++;
+        }
+    }
+
+    double count = (double)values.size();
+    printf("%-12s %8zu %14.1f %14.1f %9.1fx\n", name, values.size(),
+           compareNs / count, keyedNs / count, compareNs / keyedNs);
+    return mismatches > 0;
+}
+
+
+/* Runs op(i) for i below count in batches and prints one row: the mean
+ * ns/op, ops per second, and the 50th, 90th and 99th percentile of the
+ * per-batch ns/op
+ */
+template <typename Op>
+void benchOp(const char *name, size_t count, Op op) {
+    const size_t batch = 64;
+    vector<double> samples;
+    double totalNs = 0;
+    for (size_t i = 0; i < count; i += batch) {
+        size_t stop = min(count, i + batch);
+        auto start = chrono::steady_clock::now();
+        for (size_t k = i; k < stop; k++) {
+            op(k);
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        totalNs += ns;
+        samples.push_back(ns / (stop - i));
+    }
+    sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) { return samples[(size_t)(p * (samples.size() - 1))]; };
+    printf("%-18s %8zu %10.1f %12.0f %9.1f %9.1f %9.1f\n", name, count, totalNs / count,
+           count / totalNs * 1e9, percentile(0.5), percentile(0.9), percentile(0.99));
+}
+
+
+/* Times add, mult, div and simp over consecutive pairs of operands */
+void benchOperations(const char *name, const vector<pair<long long, long long> > &operands) {
+    volatile long long sink = 0;
+    size_t count = operands.size() - 1;
+    auto operand = [&](size_t i) { return fraction<long long>(operands[i].first, operands[i].second); };
+    string row;
+
+    row = string("add/") + name;
+    benchOp(row.c_str(), count, [&](size_t i) {
+        fraction<long long> f = operand(i);
+        f.add(operand(i + 1));
+        sink = sink + f.getNumerator();
+    });
+    row = string("mult/") + name;
+    benchOp(row.c_str(), count, [&](size_t i) {
+        fraction<long long> f = operand(i);
+        f.mult(operand(i + 1));
+        sink = sink + f.getNumerator();
+    });
+    row = string("div/") + name;
+    benchOp(row.c_str(), count, [&](size_t i) {
+        fraction<long long> f = operand(i);
+        f.div(operand(i + 1));
+        sink = sink + f.getNumerator();
+    });
+    row = string("simp/") + name;
+    benchOp(row.c_str(), count, [&](size_t i) {
+        fraction<long long> f = operand(i);
+        f.simp();
+        sink = sink + f.getNumerator();
+    });
+}
+
+
+/* Times each fraction operation over small, large, coprime and
+ * trial-division-worst operands, and parsing jobs the way main() does with
+ * cin against the stream modes' scanner
+ */
+void runOperationBenchmark(mt19937 &rng) {
+    const size_t count = 100000;
+    uniform_int_distribution<long long> small(1, 1000);
+    uniform_int_distribution<long long> large(1LL << 40, 1LL << 62);
+    const long long primes[] = { 999983, 999979, 999961, 999959, 999953, 999931, 999917, 999907 };
+    vector<pair<long long, long long> > smallOperands, largeOperands, coprimeOperands, worstOperands;
+    for (size_t i = 0; i <= count; i++) {
+        smallOperands.push_back(make_pair(small(rng), small(rng)));
+        largeOperands.push_back(make_pair(large(rng), large(rng)));
+        long long n = large(rng);
+        coprimeOperands.push_back(make_pair(n, n + 1));
+        // p / kp, which made the trial-division loop rescan the whole range
+        long long p = primes[i % 8];
+        worstOperands.push_back(make_pair(p, p * (long long)(i % 2 + 2)));
+    }
+
+    printf("\n%-18s %8s %10s %12s %9s %9s %9s\n", "operation", "count", "ns/op", "ops/sec", "p50", "p90", "p99");
+    benchOperations("small", smallOperands);
+    benchOperations("large", largeOperands);
+    benchOperations("coprime", coprimeOperands);
+    benchOperations("worst", worstOperands);
+
+    string text;
+    for (size_t i = 0; i < count; i++) {
+        text += to_string(smallOperands[i].first) + " / " + to_string(smallOperands[i].second) + " + " +
+                to_string(smallOperands[i + 1].first) + " / " + to_string(smallOperands[i + 1].second) + "\n";
+    }
+    volatile long long sink = 0;
+    istringstream in(text);
+    benchOp("parse/cin", count, [&](size_t) {
+        long long n1, d1, n2, d2;
+        char junk;
+        string op;
+        in >> n1 >> junk >> d1 >> op >> n2 >> junk >> d2;
+        sink = sink + n1 + d2;
+    });
+    const char *p = text.data();
+    const char *end = p + text.size();
+    benchOp("parse/scan", count, [&](size_t) {
+        job j;
+        p = scanJob(p, end, j);
+        sink = sink + j.n1 + j.d2;
+    });
+}
+
+
+/* Compares the binary-GCD simp() with the original trial-division loop over
+ * random, coprime and prime-heavy inputs.
+ */
+int runBenchmark(void) {
+    mt19937 rng(2019);
+    uniform_int_distribution<int> small(1, 10000);
+    uniform_int_distribution<int> large(1000000, 2000000);
+    // primes just below one million
+    const int primes[] = { 999983, 999979, 999961, 999959, 999953, 999931, 999917, 999907 };
+    vector<pair<int, int> > randomInputs, coprimeInputs, primeInputs;
+
+    for (int i = 0; i < 2000; i++) {
+        int g = small(rng);
+        randomInputs.push_back(make_pair(small(rng) * (g % 97 + 1), small(rng) * (g % 97 + 1)));
+    }
+    // consecutive integers never share a factor, so the loop runs to the end
+    for (int i = 0; i < 200; i++) {
+        int n = large(rng);
+        coprimeInputs.push_back(make_pair(n, n + 1));
+    }
+    // p / kp reduces once and then rescans the whole range
+    for (int i = 0; i < 200; i++) {
+        int p = primes[i % 8];
+        primeInputs.push_back(make_pair(p, p * (i % 2 + 2)));
+    }
+
+    printf("%-12s %8s %14s %14s %10s\n", "inputs", "count", "trial ns/op", "gcd ns/op", "speedup");
+    int failed = 0;
+    failed |= benchRow("random", randomInputs);
+    failed |= benchRow("coprime", coprimeInputs);
+    failed |= benchRow("prime-heavy", primeInputs);
+
+    // chains of 16 small operands: products only, and + mixed with * and div
+    uniform_int_distribution<int> operand(1, 12);
+    const char *mixedOps[] = { " + ", " * ", " div ", " + " };
+    vector<expression> productChains(2000), mixedChains(2000);
+    for (int i = 0; i < 2000; i++) {
+        string product, mixed;
+        for (int k = 0; k < 16; k++) {
+            string term = to_string(operand(rng)) + "/" + to_string(operand(rng));
+            product += (k > 0 ? " * " : "") + term;
+            mixed += (k > 0 ? mixedOps[operand(rng) % 4] : "") + term;
+        }
+        productChains[i].parse(product.data(), product.data() + product.size());
+        mixedChains[i].parse(mixed.data(), mixed.data() + mixed.size());
+    }
+    printf("\n%-12s %8s %14s %14s %10s\n", "chains", "count", "eager ns/op", "lazy ns/op", "speedup");
+    failed |= benchChains("product", productChains);
+    failed |= benchChains("mixed", mixedChains);
+
+    // small operands fit one varint byte, large ones need most of ten
+    uniform_int_distribution<long long> wide(-LLONG_MAX, LLONG_MAX);
+    const char ops[] = { '+', '*', 'd' };
+    vector<job> smallJobs(100000), largeJobs(100000);
+    for (int i = 0; i < 100000; i++) {
+        job s = { operand(rng), operand(rng), operand(rng), operand(rng), ops[i % 3] };
+        job l = { wide(rng), wide(rng), wide(rng), wide(rng), ops[i % 3] };
+        smallJobs[i] = s;
+        largeJobs[i] = l;
+    }
+    printf("\n%-12s %8s %14s %14s %10s\n", "jobs", "count", "text ns/op", "binary ns/op", "speedup");
+    failed |= benchParse("small", smallJobs);
+    failed |= benchParse("large", largeJobs);
+    printf("\n%-12s %8s %14s %14s %10s\n", "stream", "count", "piped ns/op", "mapped ns/op", "speedup");
+    failed |= benchStream("small", smallJobs);
+
+    // near 1 with huge terms, many fractions are within a double's precision
+    uniform_int_distribution<long long> huge(LLONG_MAX / 2, LLONG_MAX - 1);
+    vector<fraction<long long> > spreadValues, closeValues;
+    for (int i = 0; i < 200000; i++) {
+        spreadValues.push_back(fraction<long long>(wide(rng), huge(rng)));
+        long long d = huge(rng);
+        closeValues.push_back(fraction<long long>(d - i % 1000, d));
+        spreadValues.back().simp();
+        closeValues.back().simp();
+    }
+    printf("\n%-12s %8s %14s %14s %10s\n", "sort", "count", "compare ns/op", "keyed ns/op", "speedup");
+    failed |= benchSort("spread", spreadValues);
+    failed |= benchSort("close", closeValues);
+
+    runOperationBenchmark(rng);
+    if (failed) {
+        fprintf(stderr, "benchmark: reductions disagree\n");
     }
+    return failed;
 }
@@ -10,6 +10,10 @@
  * when all of the gold has been collected.
  *
  * Usage: ./server mapFile seed (seed is optional)
+ *        ./server -games N [-workers W] [-port P] [-seed S] mapFile...
+ *   The second form hosts N games in one process on W worker
+ *   threads (see runGames); a finished game is replaced by a
+ *   new one on the same map.
  *
  * Input: 2 arguments to stdin (see above)
  *
@@ -17,18 +21,33 @@
  *   - messages (map strings, gold information, game summary, etc.)
  *     send to players and spectator
  *     a list of URLs) is outputted to stdout
+ *   - a log of messages and events on stderr, written by a
+ *     background thread; NUGGETS_LOG=error, info (the default)
+ *     or debug picks how much (debug adds every map sent)
+ *
+ * Build with -pthread.
  *
  * Team CASH
  *
  */
 
+#define _GNU_SOURCE  // sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <errno.h>
 #include <time.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <unistd.h>
 #include "log.h"
 #include "file.h"
 #include "message.h"
@@ -42,50 +61,349 @@
 #define GoldTotal 250      // amount of gold in the game
 #define GoldMinNumPiles 10 // minimum number of gold piles
 #define GoldMaxNumPiles 30 // maximum number of gold piles
+#define FrameHistory 16    // frames kept per client as bases for deltas
+#define KeyframeInterval 64  // most deltas sent between two keyframes
+#define DeltaMergeGap 6    // unchanged cells a delta run may span
+#define AddrIndexBits 6    // the address index has 1<<AddrIndexBits entries
+#define LogRingSize 4096   // log records waiting for the drain thread, a power of two
+#define LogPayload 40      // bytes of message text kept in a log record
+#define BroadcastCopySize 24  // longest message broadcastCopy keeps, with its '\0'
+#define FrameHeaderSize 32 // longest FRAME or DELTA header, with its '\0'
+#define TileRows 16        // map rows in a tile
+#define TileCols 64        // map columns in a tile
+#define TileMessageSize 1200  // longest TILE message, with its '\0': under the path MTU
+#define TileSpaceSize (TileMessageSize*(MaxPlayers+1))  // TILE messages built before a flush
+#define MaxWorkers 63      // worker threads in multi-game mode
+#define MaxTickHz 1000     // fastest tick in tick mode
+#define TickQueueKeys 8    // keys a player may send per tick; more are dropped
+#define MaxLogRings (MaxWorkers+1)  // threads that log: the workers and main
+
+/**************** types ****************/
+/* Frames sent to a client that asked for delta updates. The last
+ * FrameHistory frames are kept by sequence number, so that an ACK for
+ * any of them makes it the base of the next delta. A client that
+ * asked for tiles instead has the map as it was sent to it in
+ * tiles, and the version of each tile.
+ */
+typedef struct clientFrames {
+  bool delta;                   // client sent DELTA
+  int seq;                      // sequence number of the last frame sent
+  int acked;                    // newest frame the client acknowledged, -1 if none
+  int sinceKeyframe;            // deltas sent since the last keyframe
+  char *history[FrameHistory];  // frame seq is kept in history[seq%FrameHistory]
+  int historySeq[FrameHistory];
+  bool tiles;                   // client sent TILES
+  int top, left, rows, cols;    // the client's viewport, in map cells
+  char *tileMap;                // the map as the client has it
+  int *tileVersions;            // by tile row, then tile column
+} clientFrames_t;
+
+/* What one player can see. Cells are offsets into the map string,
+ * so row y, column x is cell y*(nC+1)+x. A player's map is drawn
+ * from these bits and the game's map only when it is sent.
+ */
+typedef struct playerView {
+  bool active;        // built once the player is on the board
+  bool changed;       // recomputed, or asked for deltas, since the player's last map
+  int x, y;           // position the view was computed from
+  uint64_t *visible;  // one bit per cell in sight now
+  uint64_t *seen;     // one bit per cell ever in sight
+} playerView_t;
+
+/* A stretch of cells in one row, all in sight */
+typedef struct sightRun {
+  int start;
+  int length;
+} sightRun_t;
+
+/* Cells in sight from every room spot and passage, built once
+ * per map file from the bare map and only read after that, by
+ * every game on the map: the runs for cell c are runs[i] for
+ * first[c] <= i < first[c+1].
+ */
+typedef struct sight {
+  int numCells;  // cells in the map string
+  int *first;
+  sightRun_t *runs;
+  int numRuns;
+} sight_t;
+
+/* Players are found by hashing their IP address and port
+ * rather than comparing addresses one by one. Entries stay
+ * when a player quits, since the player keeps their slot.
+ */
+typedef struct addrEntry {
+  bool used;
+  addr_t addr;
+  int slot;  // player slot in the players array
+} addrEntry_t;
+
+/* What stands on a cell of the map: the index of a gold bag in
+ * goldBags and the slot of a player, or -1 for none.
+ */
+typedef struct occupant {
+  signed char bag;
+  signed char player;
+} occupant_t;
+
+/* Everything the server keeps for one game besides the game
+ * information itself. The game being handled on a thread is
+ * the one game points to.
+ */
+typedef struct game {
+  int id;
+  gameInfo_t *gameInfo;
+  player_t *players[MaxPlayers+1];  // gameInfo->players, ending in NULL
+  clientFrames_t clientFrames[MaxPlayers+1];  // by player slot; the spectator's is last
+  playerView_t playerViews[MaxPlayers];  // by player slot
+  int numCells;          // cells in the map string
+  /* Room to build each client's map message in until the broadcast
+   * goes out, frameStride bytes by slot with the spectator's last:
+   * a header, the map drawn by renderView, and a delta.
+   */
+  char *frameSpace;
+  int frameStride;
+  char *lastMap;           // the game's map as it was when maps were last sent
+  char *tileSpace;         // TILE messages waiting for the broadcast to go out
+  int tileUsed;            // bytes of tileSpace they take
+  uint64_t *mapChanges;    // one bit per cell that differed from lastMap then
+  const sight_t *sight;  // the map's sight tables, shared with the other games on it
+  addrEntry_t addrIndex[1<<AddrIndexBits];
+  occupant_t *occupants;  // by cell, like the map string
+  char randomState[128];  // the game's random() state, as big as the one srandom seeds
+  int goldTaken[MaxPlayers];  // nuggets each player picked up since the last GOLD message
+  /* Tick mode: keys received since the last tick, by player slot
+   * in the order they came, and what the tick has to send
+   */
+  char tickKeys[MaxPlayers][TickQueueKeys];
+  int numTickKeys[MaxPlayers];
+  bool mapsDue;
+  bool goldDue;
+} game_t;
+
+static _Thread_local game_t *game;
+static int *blockedSums;  // while sightNew builds: non-room cells above and left of each corner
+
+/* A thread hosting some of the games in multi-game mode, on a
+ * socket of its own: game g belongs to worker g%numWorkers and
+ * is games[g/numWorkers] there. Clients are routed to the game
+ * they joined through an address index like a game's, whose
+ * slots are game numbers.
+ */
+typedef struct worker {
+  int id;
+  int socket;
+  int port;
+  game_t **games;
+  addrEntry_t *routes;
+  int routeBits;       // routes has 1<<routeBits entries
+  int numRoutes;
+  pthread_t thread;
+} worker_t;
+
+static int numGames;          // multi-game mode only, like what follows
+static int numWorkers;
+static char **mapTexts;       // game g is played on mapTexts[g%numMaps]
+static int numMaps;
+static sight_t **mapSights;   // built at startup for each of mapTexts, read by its games
+static bool seeded;           // game g is then seeded with baseSeed+g
+static atomic_int gamesStarted;  // otherwise each game takes the next seed after baseSeed
+static int stopEvent = -1;    // tells the workers to stop
+static int baseSeed;          // in either mode; the time if no seed is given
+/* random() keeps one current state for the process, so a game
+ * makes its own randomState current with setstate while it
+ * holds the lock. It puts the one before back before letting
+ * go, since switching away saves the position in the state
+ * being left: a game's state is never current once the game
+ * can be freed.
+ */
+static pthread_mutex_t randomLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int tickHz;  // ticks per second in tick mode; 0 sends updates as each message is handled
+static _Thread_local struct timespec nextTick;  // when the thread's games tick next
+
+/* Datagrams waiting to go out together in one sendmmsg call,
+ * at most one per player and the spectator. Each is a header
+ * and possibly a body, sent as they lie rather than copied
+ * together: recipients of the same message share its buffers,
+ * which must last until broadcastFlush. Short messages can be
+ * kept in copies instead, once for each distinct text.
+ */
+typedef struct broadcast {
+  int count;
+  addr_t to[MaxPlayers+1];
+  struct iovec parts[MaxPlayers+1][2];
+  int numParts[MaxPlayers+1];
+  int numCopies;
+  char copies[MaxPlayers+1][BroadcastCopySize];
+} broadcast_t;
+
+static _Thread_local int messageSocket = -1;  // the socket broadcasts go out through, if any
+static _Thread_local int workerSocket = -1;   // the worker's socket, which it sends everything through
+static _Atomic long broadcastDatagrams;  // datagrams sent through broadcasts
+static _Atomic long broadcastCalls;      // system calls they took
+static _Atomic long broadcastDropped;    // datagrams the kernel refused
+static _Atomic long mapsSent;            // player maps sent
+static _Atomic long mapsSkipped;         // player maps not sent, nothing in sight having changed
+
+/* Log levels; a record is kept if its level is at most logLevel */
+enum { LogError, LogInfo, LogDebug };
+
+/* What a log record says happened */
+enum {
+  LogText,            // a message received or sent, in text
+  LogGold,            // a GOLD message sent, in values
+  LogNewSpectator,
+  LogSpectatorQuit,
+  LogNewPlayer,
+  LogMaxPlayers,
+  LogInvalidKey,
+  LogNullArg,
+};
+
+/* One logged event, kept in binary until the drain thread
+ * formats it. Text longer than the payload is cut short.
+ */
+typedef struct logRecord {
+  int64_t nanos;     // since the logger started
+  uint32_t ip;       // client address in network order, if hasAddr
+  uint16_t port;
+  bool hasAddr;
+  uint8_t event;
+  union {
+    char text[LogPayload];
+    int values[3];
+  } payload;
+} logRecord_t;
+
+/* The records of one thread that logs. The thread is the only
+ * producer: it fills records[head] and then publishes it by
+ * advancing head. The drain thread consumes up to head and
+ * advances tail. A record that finds the ring full is dropped
+ * and counted, so logging never waits for stderr.
+ */
+typedef struct logRing {
+  logRecord_t records[LogRingSize];
+  _Atomic uint64_t head;
+  _Atomic uint64_t tail;
+  _Atomic uint64_t dropped;
+  uint64_t reported;  // drops the drain thread has reported
+} logRing_t;
+
+static logRing_t *_Atomic logRings[MaxLogRings];  // made as threads first log
+static atomic_int numLogRings;
+static _Thread_local logRing_t *logRing;  // this thread's
+static atomic_bool logStopping;
+static int logLevel = LogInfo;
+static struct timespec logStart;
+static pthread_t logThread;
+static bool logRunning;
 
 /**************** prototypes ****************/
 int validateArgs(int argc, char *mapFileInput, char *seedInput, FILE *fp);
 void goldInit(gameInfo_t *gameInfo);
 void gridInit(gameInfo_t *gridInfo);
 static bool handleMessage(void *arg, const addr_t from, const char *message);
+static bool handleTickMessage(void *arg, const addr_t from, const char *message);
+static bool handleTimeout(void *arg);
+int applyKey(gameInfo_t *gameInfo, addr_t clientAddr, char C);
 int newMove(gameInfo_t *gameInfo, addr_t clientAddr, char C);
 int isNum(char *input);
 void connectSpectator(gameInfo_t *gameInfo, addr_t clientAddr);
 void connectNewPlayer(gameInfo_t *gameInfo, const char *message, addr_t clientAddr);
 bool addNewPlayer(gameInfo_t *gameInfo, const char *playerName, addr_t clientAddr);
 void sendMap(map_t *map, gameInfo_t *gameInfo);
-void sendGoldInfo(addr_t clientAddr, goldBag_t *gb, gameInfo_t *gameInfo, int p);
+void markMapChanges(gameInfo_t *gameInfo);
+bool viewChanged(playerView_t *view);
+void sendFrame(broadcast_t *batch, addr_t clientAddr, clientFrames_t *frames, const char *grid, int nC,
+               char *header, char *delta);
+int writeDelta(char *out, const char *base, const char *grid, int nC, int limit);
+int findClientSlot(gameInfo_t *gameInfo, addr_t clientAddr);
+void resetClientFrames(clientFrames_t *frames);
+void startTiles(gameInfo_t *gameInfo, clientFrames_t *frames);
+bool displayFits(void);
+void sendTiles(broadcast_t *batch, addr_t clientAddr, clientFrames_t *frames, const char *grid, int nC);
+sight_t *sightNew(char *gridRaw);
+void sightDelete(sight_t *sight);
+void viewsInit(gameInfo_t *gameInfo);
+int scanSight(map_t *mapRaw, int px, int py, int *cells, int *queue, uint64_t *queued);
+void refreshViews(gameInfo_t *gameInfo);
+void computeView(gameInfo_t *gameInfo, playerView_t *view, player_t *player);
+void markRun(uint64_t *bits, int start, int length);
+void renderView(gameInfo_t *gameInfo, playerView_t *view, char *out);
+bool lineOfSight(map_t *mapRaw, int px, int py, int tx, int ty);
+bool isRoomSpot(map_t *mapRaw, int x, int y);
+bool isOpenBox(map_t *mapRaw, int x0, int y0, int x1, int y1);
+void deleteViews(void);
+void occupantsInit(gameInfo_t *gameInfo);
+int hashAddr(addr_t addr, int bits);
+void indexPlayer(gameInfo_t *gameInfo, int slot);
+int lookupSlot(addr_t clientAddr);
+player_t *lookupPlayer(gameInfo_t *gameInfo, addr_t clientAddr);
+void trackMove(gameInfo_t *gameInfo, int slot, int from);
+goldBag_t *takeGoldBag(gameInfo_t *gameInfo);
+void sendGoldInfo(gameInfo_t *gameInfo);
+void goldChanged(gameInfo_t *gameInfo, addr_t clientAddr, int n);
+void mapChanged(gameInfo_t *gameInfo);
+bool runTick(gameInfo_t *gameInfo);
+bool tickDue(void);
+int formatGold(char *out, int n, int p, int r);
 void sendSummary(gameInfo_t *gameInfo, int numPlayers);
 void deleteGameInfo(gameInfo_t *gameInfo);
 void getColRow(char *gridRaw, int *col, int *row);
-int numDigits(int num);
+int formatInt(char *out, int num);
+game_t *gameNew(char *gridRaw, int id, const sight_t *sight, unsigned int seed);
+void gameDelete(game_t *oldGame);
+int runGames(int argc, char *argv[]);
+game_t *gameStart(int g);
+void *workerRun(void *arg);
+void workerDispatch(worker_t *worker, addr_t from, const char *message);
+void workerReplace(worker_t *worker, int g);
+int routeLookup(worker_t *worker, addr_t from);
+void routeAdd(worker_t *worker, addr_t from, int g);
+void routeRebuild(worker_t *worker, int dropGame);
+void sendMessage(addr_t to, const char *message);
+int openBroadcastSocket(void);
+void sendParts(addr_t to, struct iovec *parts, int numParts);
+void broadcastAdd(broadcast_t *batch, addr_t to, const char *header, const char *body);
+void broadcastCopy(broadcast_t *batch, addr_t to, const char *text);
+void broadcastFlush(broadcast_t *batch);
+void loggerInit(void);
+void loggerDone(void);
+void logEvent(int level, int event, const addr_t *addr, const char *text);
+void logGold(int level, const addr_t *addr, int n, int p, int r);
+logRecord_t *logClaim(int level, int event, const addr_t *addr);
+void logPublish(void);
+void *loggerDrain(void *arg);
+void loggerWrite(FILE *fp, const logRecord_t *record);
 
 /**************** main ****************/
 int main(int argc, char *argv[])
 {
   // LOCAL VARIABLES
   FILE *fp = NULL;
-  gameInfo_t *gameInfo = malloc(sizeof(gameInfo_t));  // structure to hold information about game
-  map_t *mapRaw = malloc(sizeof(map_t));  // structure to hold original map string
-  map_t *map = malloc(sizeof(map_t));
-  char *gridRaw;
-  char *grid;
-  int numPlayers = 0;
   int result = 0;
-  player_t *players[MaxPlayers];  // array of player_t pointers, initialized as NULL
-  player_t *spectator = malloc(sizeof(player_t));
-  for (int i=0; i<MaxPlayers; i++) {
-    players[i] = NULL;
+
+  // MANY GAMES IN ONE PROCESS
+  if (argc > 1 && strcmp(argv[1], "-games")==0) {
+    return runGames(argc, argv);
+  }
+
+  // TICK MODE, given after the other arguments
+  if (argc > 3 && strcmp(argv[argc-2], "-tick")==0) {
+    tickHz = atoi(argv[argc-1]);
+    if (!isNum(argv[argc-1]) || argv[argc-1][0]=='\0' || tickHz > MaxTickHz) {
+      printf("%s is not a valid tick rate\n", argv[argc-1]);
+      fprintf(stderr, "%s is not a valid tick rate\n", argv[argc-1]);
+      return 1;
+    }
+    argc -= 2;
   }
   
   // VALIDATE ARGUMENTS
   fp = fopen(argv[1], "r");
   result = validateArgs(argc, argv[1], argv[2], fp);
   if (result>0) {
-    free(spectator);
-    free(mapRaw);
-    free(map);
-    free(gameInfo);
     if (result==1) {
       return 1;  //wrong number of arguments   
     } else if (result==2) {
@@ -97,34 +415,37 @@ int main(int argc, char *argv[])
   }
   else {
     
-    // INITIALIZE GAME INFO STRUCTURE
-    gameInfo->players = players;  // add players to structure
-    gameInfo->numPlayers = numPlayers;
-    gameInfo->mapRaw = mapRaw;
-    gameInfo->map = map;
-    gridRaw = freadfilep(fp);  // create 2 copies of map string
-    grid = malloc(strlen(gridRaw)+1);
-    strcpy(grid, gridRaw);
-    gameInfo->mapRaw->grids = gridRaw;  // add map strings to structure
-    gameInfo->map->grids = grid;    
-    gameInfo->spectator = spectator;  // add spectator to structure
-    gameInfo->spectator->connected=false;
-    
-    // INITIALIZE GRID (rows and columns)
-    gridInit(gameInfo);
-
-    // INITIALIZE GOLD BAGS
-    goldInit(gameInfo);
+    // INITIALIZE GAME
+    char *gridRaw = freadfilep(fp);
+    sight_t *sight = sightNew(gridRaw);
+    gameNew(gridRaw, 0, sight, baseSeed);
 
     // INITIALIZE SERVER
+    loggerInit();
     int port = message_init(stderr);  //inialize module and get port number
     printf("message_init: ready at port '%d'\n",port);
-    bool ok = message_loop(gameInfo, 0, NULL, NULL, handleMessage);  //wait for and handle client input
-                                                                     //stops looping when bool is true
+    messageSocket = openBroadcastSocket();  // broadcasts go out through it in batches
+    bool ok;
+    if (tickHz > 0) {
+      // wake at least four times a tick, so a quiet game still ticks on time
+      clock_gettime(CLOCK_MONOTONIC, &nextTick);
+      ok = message_loop(game->gameInfo, 0.25f/tickHz, handleTimeout, NULL, handleTickMessage);
+    } else {
+      ok = message_loop(game->gameInfo, 0, NULL, NULL, handleMessage);  //wait for and handle client input
+                                                                        //stops looping when bool is true
+    }
     // SHUT DOWN SERVER AND FREE MEMORY
+    printf("broadcast: %ld datagrams in %ld system calls, %ld saved, %ld dropped\n",
+           broadcastDatagrams, broadcastCalls, broadcastDatagrams-broadcastCalls, broadcastDropped);
+    printf("maps: %ld sent, %ld skipped as unchanged\n", mapsSent, mapsSkipped);
     message_done();
+    if (messageSocket >= 0) {
+      close(messageSocket);
+    }
+    loggerDone();
     log_done();
-    deleteGameInfo(gameInfo);
+    gameDelete(game);
+    sightDelete(sight);
     fclose(fp);
     return ok? 0 : 1;  //status code depends on result of message_loop
   }
@@ -132,6 +453,75 @@ int main(int argc, char *argv[])
 }
 
 
+/* *************** gameNew *************** */
+/* Sets up a game and makes it the one handled on this thread.
+ * The game draws its random numbers from a state of its own,
+ * so a seeded game places its gold and players the same way
+ * whatever the games on other threads do.
+ *
+ * Caller provides:
+ *   - the map string, which the game takes over
+ *   - a number for the game
+ *   - the sight tables built for the map, which must outlive
+ *     the game
+ *   - the seed for the game's random numbers
+ * We return:
+ *   - the game, with its gold placed and nobody connected
+ */
+game_t *gameNew(char *gridRaw, int id, const sight_t *sight, unsigned int seed)
+{
+  game_t *newGame = calloc(1, sizeof(game_t));
+  gameInfo_t *gameInfo = malloc(sizeof(gameInfo_t));  // structure to hold information about game
+  map_t *mapRaw = malloc(sizeof(map_t));  // structure to hold original map string
+  map_t *map = malloc(sizeof(map_t));
+  char *grid;
+  player_t *spectator = malloc(sizeof(player_t));
+  newGame->id = id;
+  newGame->gameInfo = gameInfo;
+  newGame->sight = sight;
+  game = newGame;
+
+  // INITIALIZE GAME INFO STRUCTURE
+  gameInfo->players = newGame->players;  // add players to structure, all NULL
+  gameInfo->numPlayers = 0;
+  gameInfo->mapRaw = mapRaw;
+  gameInfo->map = map;
+  grid = malloc(strlen(gridRaw)+1);  // create 2 copies of map string
+  strcpy(grid, gridRaw);
+  gameInfo->mapRaw->grids = gridRaw;  // add map strings to structure
+  gameInfo->map->grids = grid;    
+  gameInfo->spectator = spectator;  // add spectator to structure
+  gameInfo->spectator->connected=false;
+  
+  // INITIALIZE GRID (rows and columns)
+  gridInit(gameInfo);
+
+  // MAKE ROOM FOR THE VIEWS AND FRAMES
+  viewsInit(gameInfo);
+
+  // INITIALIZE GOLD BAGS
+  pthread_mutex_lock(&randomLock);
+  char *previous = initstate(seed, newGame->randomState, sizeof(newGame->randomState));
+  goldInit(gameInfo);
+  setstate(previous);
+  pthread_mutex_unlock(&randomLock);
+
+  // INDEX GOLD BAGS BY CELL
+  occupantsInit(gameInfo);
+  return newGame;
+}
+
+
+/* Frees a game and everything in it */
+void gameDelete(game_t *oldGame)
+{
+  game = oldGame;
+  deleteGameInfo(oldGame->gameInfo);
+  free(oldGame);
+  game = NULL;
+}
+
+
 /* *************** validateArgs *************** */
 /* Parces the command line arguments and determines
  * whether or not it is a valid program call.
@@ -150,8 +540,8 @@ int validateArgs(int argc, char *mapFileInput, char *seedInput, FILE *fp)
 {
   int seed;
   if ((argc!=2) && (argc!=3)) {
-    printf("usage: ./server mapFile [seed]\n");
-    fprintf(stderr, "usage: ./server mapFile [seed]\n");
+    printf("usage: ./server mapFile [seed] [-tick hz]\n");
+    fprintf(stderr, "usage: ./server mapFile [seed] [-tick hz]\n");
     return 1;  // wrong number of arguments
   } else {
     if (fp == NULL) {
@@ -162,14 +552,14 @@ int validateArgs(int argc, char *mapFileInput, char *seedInput, FILE *fp)
       if (argc==3) {  // seed was provided
         if (isNum(seedInput)) {  // check if seed is a number
           seed = atoi(seedInput);
-          srandom(seed);  // call random() whenever a random number is needed
+          baseSeed = seed;  // the game seeds its random() state with it
         } else {
           printf("%s is not a valid seed\n", seedInput);
           fprintf(stderr, "%s is not a valid seed\n", seedInput);
           return 3;  // invalid seed
         }
       } else {  // seed was not provided
-        srandom(time(NULL));
+        baseSeed = time(NULL);
       }
     }
   }
@@ -227,13 +617,25 @@ void gridInit(gameInfo_t *gameInfo)
  *   - SPECTATE: indicates spectator connecting
  *   - PLAY: indicates player connecting
  *   - KEY: indicates player moving or quitting
+ *   - DELTA: client wants FRAME and DELTA instead of DISPLAY
+ *   - ACK seq: client has applied frame seq
+ *   - TILES: client wants TILE instead of DISPLAY
+ *   - VIEW top left rows cols: tile client's viewport, in
+ *     map cells; the whole map until it sends one
  * Messages are sent back to the user to indicate:
  *   - OK: gives letter of player
  *   - NO...: indicates an error
  *   - GRID: number of rows and columns in grid
  *   - DISPLAY: map string
+ *   - FRAME seq: map string numbered seq (delta clients)
+ *   - DELTA base seq: changes that turn frame base into frame seq
+ *     (delta clients, see sendFrame)
+ *   - TILE row col version: a changed piece of the map in the
+ *     client's viewport (tile clients, see sendTiles)
  *   - GOLD n p r: current gold bag information
  *   - GAMEOVER: sends summary of game after game is over
+ * In tick mode keys are queued for runTick, and maps and GOLD
+ * go out when the tick ends rather than as messages come.
  *
  * Caller provides:
  *   - structure of game information
@@ -250,23 +652,20 @@ static bool handleMessage(void *arg, const addr_t from, const char *message)
   gameInfo_t *gameInfo = (gameInfo_t *)arg;
 
   if (arg==NULL) {
-    fprintf(stderr, "handleMessage called with arg=NULL\n");
+    logEvent(LogError, LogNullArg, NULL, NULL);
     return true;
   }
 
   // sender becomes our correspondent
   clientAddr = from;
 
-  fprintf(stderr, "[%s@%05d]: %s\n", 
-         inet_ntoa(from.sin_addr), //IP address of the sender
-         ntohs(from.sin_port),     //port number of the sender
-         message);                 //message from the sender
+  logEvent(LogInfo, LogText, &from, message);
 
   // check if maximum players have already been reached
   if (gameInfo->numPlayers > MaxPlayers) {
-    message_send(clientAddr, "NO Maximum players reached");
+    sendMessage(clientAddr, "NO Maximum players reached");
     if (strcmp(message, "KEY Q")==0) {
-      message_send(clientAddr, "QUIT");
+      sendMessage(clientAddr, "QUIT");
     }
     return false;
   } else {
@@ -289,32 +688,99 @@ static bool handleMessage(void *arg, const addr_t from, const char *message)
       // disconnect spectator
       if (gameInfo->spectator->connected) {
         if (message_eqAddr(gameInfo->spectator->clientAddr, clientAddr)) {
-          message_send(clientAddr, "QUIT");
-          fprintf(stderr, "[%s@%05d]: spectator quit\n", inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+          sendMessage(clientAddr, "QUIT");
+          logEvent(LogInfo, LogSpectatorQuit, &from, NULL);
           gameInfo->spectator->connected=false;
         }
       }
       // disconnect player
-      else if ((findPlayer(gameInfo, clientAddr) != NULL)) {
+      else if (lookupSlot(clientAddr) >= 0) {
+        int slot = lookupSlot(clientAddr);
+        player_t *player = gameInfo->players[slot];
+        int cell = player->y*(gameInfo->map->nC+1)+player->x;
+        if (game->occupants[cell].player == slot) {
+          game->occupants[cell].player = -1;
+        }
         playerQuit(gameInfo, clientAddr);  //remove player from board
-        sendMap(gameInfo->map, gameInfo);  //send updated map to all players
+        game->numTickKeys[slot] = 0;  // keys still queued are dropped
+        refreshViews(gameInfo);  //drop the player's view
+        mapChanged(gameInfo);  //send updated map to all players
       }
       return false;
     }
     
+    // CLIENT ASKS FOR DELTA UPDATES (a map that takes tiles keeps them)
+    else if (strcmp(message, "DELTA")==0) {
+      int slot = findClientSlot(gameInfo, clientAddr);
+      if (slot >= 0 && displayFits()) {
+        resetClientFrames(&game->clientFrames[slot]);
+        game->clientFrames[slot].delta = true;
+        if (slot < MaxPlayers) {
+          game->playerViews[slot].changed = true;  // the keyframe must go out
+        }
+        mapChanged(gameInfo);  // starts this client off with a keyframe
+      }
+      return false;
+    }
+
+    // CLIENT ASKS FOR TILES
+    else if (strcmp(message, "TILES")==0) {
+      int slot = findClientSlot(gameInfo, clientAddr);
+      if (slot >= 0) {
+        startTiles(gameInfo, &game->clientFrames[slot]);
+        if (slot < MaxPlayers) {
+          game->playerViews[slot].changed = true;  // every tile in view must go out
+        }
+        mapChanged(gameInfo);
+      }
+      return false;
+    }
+
+    // TILE CLIENT MOVES ITS VIEWPORT
+    else if (strncmp(message, "VIEW ", 5)==0) {
+      int slot = findClientSlot(gameInfo, clientAddr);
+      int top, left, rows, cols;
+      if (slot >= 0 && game->clientFrames[slot].tiles
+          && sscanf(message+5, "%d %d %d %d", &top, &left, &rows, &cols)==4 && rows > 0 && cols > 0) {
+        clientFrames_t *frames = &game->clientFrames[slot];
+        frames->top = top;
+        frames->left = left;
+        frames->rows = rows;
+        frames->cols = cols;
+        if (slot < MaxPlayers) {
+          game->playerViews[slot].changed = true;  // tiles coming into view must go out
+        }
+        mapChanged(gameInfo);
+      }
+      return false;
+    }
+
+    // CLIENT ACKNOWLEDGES A FRAME
+    else if (strncmp(message, "ACK ", 4)==0 && isNum((char *)message+4) && message[4]!='\0') {
+      int slot = findClientSlot(gameInfo, clientAddr);
+      int seq = atoi(message+4);
+      if (slot >= 0 && game->clientFrames[slot].delta && seq > game->clientFrames[slot].acked
+          && seq <= game->clientFrames[slot].seq) {
+        game->clientFrames[slot].acked = seq;
+      }
+      return false;
+    }
+
+    // PLAYER MAKES A MOVE ON THE NEXT TICK
+    else if (tickHz > 0 && message[0]=='K' && message[1]=='E' && message[2]=='Y') {
+      int slot = lookupSlot(clientAddr);
+      if (slot >= 0 && game->numTickKeys[slot] < TickQueueKeys) {
+        game->tickKeys[slot][game->numTickKeys[slot]++] = message[4];
+      }
+      return false;
+    }
+
     // PLAYER MAKES A MOVE
     else if (message[0]=='K' && message[1]=='E' && message[2]=='Y') {
-      int result = newMove(gameInfo, clientAddr, message[4]);
-      // valid move to a gold bag   
-      if (result == 2) {
-        goldBag_t *gb = findGoldBag(GoldMaxNumPiles, gameInfo->x, gameInfo->y, gameInfo->goldBags); // pointer to goldbag structure you landed on
-        gameInfo->totalGold -= gb->numNugs;  // subtracts gold from total
-        player_t *ptr = findPlayer(gameInfo, clientAddr);
-        sendGoldInfo(clientAddr, gb, gameInfo, ptr->numNugs);  // send gold info to all players
-      }
+      int result = applyKey(gameInfo, clientAddr, message[4]);
       // valid move
       if (result>0) {
-        updateVisibility(gameInfo->map, gameInfo->players, MaxPlayers, gameInfo->mapRaw);  //update visibility for all players
+        refreshViews(gameInfo);  //update visibility for players who moved
         sendMap(gameInfo->map, gameInfo); //send map to all players
         // end game if all gold has been collected
         if (gameInfo->totalGold==0) {
@@ -330,6 +796,126 @@ static bool handleMessage(void *arg, const addr_t from, const char *message)
 }
 
 
+/* ********************* handleTickMessage ********************** */
+/* Handles a message in tick mode, then runs the tick if its
+ * time has come.
+ *
+ * We return:
+ *   - true if the server should quit (game is over)
+ */
+static bool handleTickMessage(void *arg, const addr_t from, const char *message)
+{
+  if (handleMessage(arg, from, message)) {
+    return true;
+  }
+  return tickDue() && runTick((gameInfo_t *)arg);
+}
+
+
+/* Runs the tick in tick mode when no message has come for a
+ * while; true if the game is over
+ */
+static bool handleTimeout(void *arg)
+{
+  return tickDue() && runTick((gameInfo_t *)arg);
+}
+
+
+/**************** applyKey ****************/
+/* Makes a player's move and takes any gold bag they land on.
+ *
+ * Caller provides:
+ *    - structure of game information
+ *    - address of current player
+ *    - key letter entered by user
+ * We return:
+ *    - what newMove returns
+ */
+int applyKey(gameInfo_t *gameInfo, addr_t clientAddr, char C)
+{
+  int result = newMove(gameInfo, clientAddr, C);
+  // valid move to a gold bag
+  if (result == 2) {
+    goldBag_t *gb = takeGoldBag(gameInfo); // pointer to goldbag structure you landed on
+    gameInfo->totalGold -= gb->numNugs;  // subtracts gold from total
+    goldChanged(gameInfo, clientAddr, gb->numNugs);  // send gold info to all players
+  }
+  return result;
+}
+
+
+/* ********************* runTick ********************** */
+/* Applies the keys queued since the last tick and sends what
+ * changed. Keys go in rounds: every player's first key in slot
+ * order, then every player's second, so nobody's burst of keys
+ * gets ahead of the others. Views are brought up to date after
+ * each round, which is once a tick unless a player sent several
+ * keys. Each client then gets at most one map and one GOLD
+ * message for the tick.
+ *
+ * Caller provides:
+ *   - structure of game information
+ * We return:
+ *   - true if the game is over, the summary sent
+ */
+bool runTick(gameInfo_t *gameInfo)
+{
+  for (int round=0; round<TickQueueKeys; round++) {
+    bool keys = false;
+    for (int j=0; j<gameInfo->numPlayers; j++) {
+      if (round < game->numTickKeys[j]) {
+        keys = true;
+        if (gameInfo->players[j]->connected
+            && applyKey(gameInfo, gameInfo->players[j]->clientAddr, game->tickKeys[j][round]) > 0) {
+          game->mapsDue = true;
+        }
+      }
+    }
+    if (!keys) {
+      break;
+    }
+    refreshViews(gameInfo);  // the player remembers what they passed
+  }
+  memset(game->numTickKeys, 0, sizeof(game->numTickKeys));
+  if (game->mapsDue) {
+    sendMap(gameInfo->map, gameInfo);
+    game->mapsDue = false;
+  }
+  if (game->goldDue) {
+    sendGoldInfo(gameInfo);
+    game->goldDue = false;
+  }
+  // end game if all gold has been collected
+  if (gameInfo->totalGold==0) {
+    sendSummary(gameInfo, gameInfo->numPlayers);
+    return true;
+  }
+  return false;
+}
+
+
+/* Says whether this thread's games are due to tick, and if so
+ * schedules the next tick. Ticks missed while busy are skipped
+ * rather than run back to back.
+ */
+bool tickDue(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec < nextTick.tv_sec || (now.tv_sec == nextTick.tv_sec && now.tv_nsec < nextTick.tv_nsec)) {
+    return false;
+  }
+  long long period = 1000000000LL/tickHz;
+  long long next = nextTick.tv_sec*1000000000LL + nextTick.tv_nsec + period;
+  if (next <= now.tv_sec*1000000000LL + now.tv_nsec) {
+    next = now.tv_sec*1000000000LL + now.tv_nsec + period;
+  }
+  nextTick.tv_sec = next/1000000000LL;
+  nextTick.tv_nsec = next%1000000000LL;
+  return true;
+}
+
+
 /**************** newMove  ****************/
 /* Determines a player's new coordinates based
  * on the key that they pressed to make a move.
@@ -345,7 +931,9 @@ static bool handleMessage(void *arg, const addr_t from, const char *message)
  *    - n: move diagonally down and right
  * (capital letters translate into the corresponding
  * move until the player can not move any further in
- * that direction)
+ * that direction; the whole run counts as one move, so
+ * the gold picked up along the way goes out in one GOLD
+ * message and the caller sends one map at the end)
  *
  * Caller provides:
  *    - structure of game information
@@ -363,31 +951,39 @@ static bool handleMessage(void *arg, const addr_t from, const char *message)
  *    - 2 if the player landed on a gold bag
  *    - 3 if the player swapped places with another
  *      player
+ *    - for a run, 1 if the player moved at all, with
+ *      any gold already handled
  */
 int newMove(gameInfo_t *gameInfo, addr_t clientAddr, char C)
 {
   //find current coordinates of player
-  player_t *ptr = findPlayer(gameInfo, clientAddr);
+  int slot = lookupSlot(clientAddr);
+  if (slot < 0) {
+    return 0;  // not a player
+  }
+  player_t *ptr = gameInfo->players[slot];
   int x = ptr->x;
   int y = ptr->y;
+  int from = y*(gameInfo->map->nC+1)+x;
   int result=1;
   // if user entered a capital letter
   if (C=='H' || C=='J' || C=='K' || C=='L' || C=='Y' || C=='U' || C=='B' || C=='N') {
-     while (result!=0) {
-       result = newMove(gameInfo, clientAddr, C+32); // convert to corresponding lower case and move until invalid
-       if (result==-1) {  // invalid space
-         result=0;
-         return 0;
-       } else if (result==2) {  // gold bag
-         goldBag_t *gb = findGoldBag(GoldMaxNumPiles, gameInfo->x, gameInfo->y, gameInfo->goldBags); // pointer to goldbag structure you landed on
-         gameInfo->totalGold -= gb->numNugs;  // subtracts gold from total
-         player_t *ptr = findPlayer(gameInfo, clientAddr);
-         sendGoldInfo(clientAddr, gb, gameInfo, ptr->numNugs);  // send gold info to all players
-       }
-       updateVisibility(gameInfo->map, gameInfo->players, MaxPlayers, gameInfo->mapRaw);  //update visibility for all players
-       sendMap(gameInfo->map, gameInfo);  // send map to all players         
-    }
-     return 0;
+    int collected = 0;  // nuggets picked up during the run
+    bool moved = false;
+    // convert to corresponding lower case and move until invalid
+    while ((result = newMove(gameInfo, clientAddr, C+32)) > 0) {
+      moved = true;
+      if (result == 2) {  // gold bag
+        goldBag_t *gb = takeGoldBag(gameInfo); // pointer to goldbag structure you landed on
+        gameInfo->totalGold -= gb->numNugs;  // subtracts gold from total
+        collected += gb->numNugs;
+      }
+      refreshViews(gameInfo);  // the player remembers what they passed
+    }
+    if (collected > 0) {
+      goldChanged(gameInfo, clientAddr, collected);  // send gold info to all players
+    }
+    return moved ? 1 : 0;
   }
   // calculate new x,y coordinates based on the key entered
   switch(C) {
@@ -420,8 +1016,8 @@ int newMove(gameInfo_t *gameInfo, addr_t clientAddr, char C)
       y+=1;
       break;
     default:  // invalid key
-      message_send(clientAddr, "NO Invalid key");
-      fprintf(stderr, "[%s@%05d]: NO Invalid key\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+      sendMessage(clientAddr, "NO Invalid key");
+      logEvent(LogInfo, LogInvalidKey, &clientAddr, NULL);
       result=0;
       break;
   }
@@ -433,6 +1029,9 @@ int newMove(gameInfo_t *gameInfo, addr_t clientAddr, char C)
   gameInfo->y = y;
   gameInfo->ID = ptr->L;
   result = movePlayer(gameInfo);  // updates location/info players in map if valid
+  if (result > 0) {
+    trackMove(gameInfo, slot, from);
+  }
   return result;
 }
 
@@ -469,31 +1068,40 @@ int isNum(char *input) {
  *   - if an existing spectator is already connected,
  *     if spectator is already connected, kick them out
  *     and replace them with the new spectator 
+ *   - the spectator is sent tiles from the start if the
+ *     map does not fit in one DISPLAY
  */
 void connectSpectator(gameInfo_t *gameInfo, addr_t clientAddr)
 {
-  char *gridMessage;
+  char gridMessage[32];
   // if no spectator is currently connected
   if (!(gameInfo->spectator->connected)) {
     // save information in game info structure
     gameInfo->spectator->clientAddr = clientAddr;
-    fprintf(stderr, "[%s@%05d]: new spectator\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+    logEvent(LogInfo, LogNewSpectator, &clientAddr, NULL);
   } else {
     // if spectator is already connected, kick them out and replace them with the new spectator
-    message_send(gameInfo->spectator->clientAddr, "QUIT");
-    fprintf(stderr, "[%s@%05d]: new spectator\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+    sendMessage(gameInfo->spectator->clientAddr, "QUIT");
+    logEvent(LogInfo, LogNewSpectator, &clientAddr, NULL);
     gameInfo->spectator->clientAddr = clientAddr;
   }
+  resetClientFrames(&game->clientFrames[MaxPlayers]);  // the new spectator starts with DISPLAY
+  if (!displayFits()) {
+    startTiles(gameInfo, &game->clientFrames[MaxPlayers]);
+  }
   gameInfo->spectator->connected = true;
   // send grid dimensions to spectator
-  gridMessage = malloc(numDigits(gameInfo->map->nR)+(numDigits(gameInfo->map->nC)+1)+7);
-  sprintf(gridMessage, "GRID %d %d", gameInfo->map->nR, (gameInfo->map->nC)+1);
-  fprintf(stderr, "[%s@%05d]: %s\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port), gridMessage);
-  message_send(clientAddr, gridMessage);
-  free(gridMessage);
+  int length = 5;
+  memcpy(gridMessage, "GRID ", 5);
+  length += formatInt(gridMessage+length, gameInfo->map->nR);
+  gridMessage[length++] = ' ';
+  length += formatInt(gridMessage+length, (gameInfo->map->nC)+1);
+  gridMessage[length] = '\0';
+  logEvent(LogInfo, LogText, &clientAddr, gridMessage);
+  sendMessage(clientAddr, gridMessage);
   // send map and gold info to spectator
-  sendMap(gameInfo->map, gameInfo);
-  sendGoldInfo(clientAddr, NULL, gameInfo, 0);
+  mapChanged(gameInfo);
+  goldChanged(gameInfo, clientAddr, 0);
 }
 
 
@@ -510,18 +1118,28 @@ void connectSpectator(gameInfo_t *gameInfo, addr_t clientAddr)
  *   - if the max number of players has already been
  *     reached, then addNewPlayer returns false, and
  *     additional players are not allowed to connect
+ *   - the player is sent tiles from the start if the map
+ *     does not fit in one DISPLAY
  */
 void connectNewPlayer(gameInfo_t *gameInfo, const char *message, addr_t clientAddr)
 {
   if (addNewPlayer(gameInfo, message, clientAddr)) {  // add player to array
+    pthread_mutex_lock(&randomLock);
+    char *previous = setstate(game->randomState);
     randomizeOnePlayerLoc(gameInfo, clientAddr);  // add player to board with random location
-    updateVisibility(gameInfo->map, gameInfo->players, MaxPlayers, gameInfo->mapRaw);  // update visibility for all players
-    sendMap(gameInfo->map, gameInfo);  //send updated map and gold info to all players
-    sendGoldInfo(clientAddr, NULL, gameInfo, 0);
-    fprintf(stderr, "[%s@%05d]: new player\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+    setstate(previous);
+    pthread_mutex_unlock(&randomLock);
+    indexPlayer(gameInfo, gameInfo->numPlayers-1);  // playerConnect filled the last slot
+    if (!displayFits()) {
+      startTiles(gameInfo, &game->clientFrames[gameInfo->numPlayers-1]);
+    }
+    refreshViews(gameInfo);  // build the new player's view
+    mapChanged(gameInfo);  //send updated map and gold info to all players
+    goldChanged(gameInfo, clientAddr, 0);
+    logEvent(LogInfo, LogNewPlayer, &clientAddr, NULL);
   } else {
-    message_send(clientAddr, "NO Max players reached\n");
-    fprintf(stderr, "[%s@%05d]: NO Max players reached\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+    sendMessage(clientAddr, "NO Max players reached\n");
+    logEvent(LogInfo, LogMaxPlayers, &clientAddr, NULL);
   }
 }
 
@@ -545,8 +1163,8 @@ void connectNewPlayer(gameInfo_t *gameInfo, const char *message, addr_t clientAd
  */
 bool addNewPlayer(gameInfo_t *gameInfo, const char *message, addr_t clientAddr) {
   char *playerName;
-  char *nameMessage;
-  char *gridMessage;
+  char nameMessage[] = "OK ?";
+  char gridMessage[32];
   gameInfo->numPlayers++;  // increase number of players 
   playerName = malloc(strlen(message+5)+1);
   strcpy(playerName, message+5);
@@ -556,17 +1174,18 @@ bool addNewPlayer(gameInfo_t *gameInfo, const char *message, addr_t clientAddr)
     return false;  // max number of players was reached
   } else {
     // send letter of player
-    nameMessage = malloc(5*sizeof(char));
-    sprintf(nameMessage, "OK %c", newplayer->L);
-    message_send(clientAddr, nameMessage);
-    fprintf(stderr, "[%s@%05d]: %s\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port), nameMessage);
+    nameMessage[3] = newplayer->L;
+    sendMessage(clientAddr, nameMessage);
+    logEvent(LogInfo, LogText, &clientAddr, nameMessage);
     // send grid dimensions to new player
-    gridMessage = malloc(numDigits(gameInfo->map->nR)+(numDigits(gameInfo->map->nC)+1)+7);
-    sprintf(gridMessage, "GRID %d %d", gameInfo->map->nR, (gameInfo->map->nC)+1);
-    fprintf(stderr, "[%s@%05d]: %s\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port), gridMessage);
-    message_send(clientAddr, gridMessage);
-    free(nameMessage);
-    free(gridMessage);
+    int length = 5;
+    memcpy(gridMessage, "GRID ", 5);
+    length += formatInt(gridMessage+length, gameInfo->map->nR);
+    gridMessage[length++] = ' ';
+    length += formatInt(gridMessage+length, (gameInfo->map->nC)+1);
+    gridMessage[length] = '\0';
+    logEvent(LogInfo, LogText, &clientAddr, gridMessage);
+    sendMessage(clientAddr, gridMessage);
     free(playerName);
     return true;
   }
@@ -582,173 +1201,1807 @@ bool addNewPlayer(gameInfo_t *gameInfo, const char *message, addr_t clientAddr)
  *   - the current map of the game
  * We guarantee:
  *   - only the part of the map that is visible to each player
- *     is sent to those players. Invisible spots in the map are
- *     represented as spaces in the map string
- *   - the spectator is allowed to see the entire board
- *   - memory for the message string is allocated and freed
+ *     is sent to those players, drawn from their view as it is
+ *     sent. Invisible spots in the map are represented as
+ *     spaces in the map string
+ *   - a player is sent a map only if it differs from their
+ *     last one: they moved or joined, or a cell in their sight
+ *     changed. What they only remember is drawn from the bare
+ *     map, which never changes
+ *   - the spectator is allowed to see the entire board, and
+ *     gets it every time
+ *   - clients that asked for deltas get a FRAME or DELTA
+ *     (see sendFrame), clients that asked for tiles the TILE
+ *     messages that changed (see sendTiles), everyone else a
+ *     DISPLAY
+ *   - the maps go out together in one broadcast, built in
+ *     the game's frame space without allocating
  */
 void sendMap(map_t *map, gameInfo_t *gameInfo)
 {
   if (map->grids!=NULL) {
-    char *mapMessage = malloc(strlen(map->grids)+11);
+    broadcast_t batch = {.count = 0};
     int j;
-    // send visible map to all connected players
+    markMapChanges(gameInfo);
+    // send visible map to all connected players whose map changed
     for (j=0; j<gameInfo->numPlayers; j++) {
-      if (gameInfo->players[j]->connected == true) {
-        sprintf(mapMessage, "DISPLAY\n%s", gameInfo->players[j]->map->grids);
-        message_send(gameInfo->players[j]->clientAddr, mapMessage);
+      if (gameInfo->players[j]->connected == true && game->playerViews[j].active) {
+        if (!viewChanged(&game->playerViews[j])) {
+          mapsSkipped++;
+          continue;
+        }
+        game->playerViews[j].changed = false;
+        mapsSent++;
+        char *header = game->frameSpace + j*game->frameStride;
+        char *grid = header+FrameHeaderSize;
+        renderView(gameInfo, &game->playerViews[j], grid);
+        sendFrame(&batch, gameInfo->players[j]->clientAddr, &game->clientFrames[j], grid,
+                  map->nC, header, grid+game->numCells+1);
       }
     }
     // send whole map to spectator
     if (gameInfo->spectator->connected) {
-      sprintf(mapMessage, "DISPLAY\n%s", gameInfo->map->grids);
-      message_send(gameInfo->spectator->clientAddr, mapMessage); 
+      char *header = game->frameSpace + MaxPlayers*game->frameStride;
+      sendFrame(&batch, gameInfo->spectator->clientAddr, &game->clientFrames[MaxPlayers], gameInfo->map->grids,
+                map->nC, header, header+FrameHeaderSize+game->numCells+1);
     }
-    free(mapMessage);
+    broadcastFlush(&batch);
+    game->tileUsed = 0;
   }
 }
 
 
-/* ********************* sendGoldInfo ********************** */
-/* Sends updated gold info to all players after a player picks
- * up a gold bag.
+/* ********************* markMapChanges ********************** */
+/* Finds the cells of the game's map that changed since maps
+ * were last sent, by comparing it with lastMap a word of cells
+ * at a time, and brings lastMap up to date.
  *
  * Caller provides:
- *    - address of client
- *    - pointer to goldbag that was picked up by current client
- *    - number of nuggets currently in that clients purse
- *    - structure of game information
+ *   - structure of game information
  * We guarantee:
- *    - the updated n, p, and r is send to the corresponding
- *      players
- *    - memory for the message string is allocated and freed 
+ *   - game->mapChanges has a bit set for each changed cell
  */
-void sendGoldInfo(addr_t clientAddr, goldBag_t *gb, gameInfo_t *gameInfo, int p)
+void markMapChanges(gameInfo_t *gameInfo)
 {
-  int n;  // number of nuggets picked up by player
-  int r;  // number of gold nuggets remainin
-  char *goldMessage = malloc(17*sizeof(char));  // string with gold info to be sent to client
-  if (gb!=NULL) {
-    n = gb->numNugs;  // if nuggets were picked up
-  } else {
-    n=0;  // if no nuggets were picked up
-  }
-  r = gameInfo->totalGold;
-  for (int i=0; i<gameInfo->numPlayers; i++) {
-    // send new n, p, r to player that picked up gold 
-    if (message_eqAddr(gameInfo->players[i]->clientAddr, clientAddr)) {
-     sprintf(goldMessage, "GOLD %d %d %d", n, p, r);
-     fprintf(stderr, "[%s@%05d]: %s\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port), goldMessage);
-     message_send(clientAddr, goldMessage);
-    }
-    // send new r to everyone else
-    else if (gameInfo->players[i]->connected == true) {
-      sprintf(goldMessage, "GOLD %d %d %d", 0, gameInfo->players[i]->numNugs, r);
-      fprintf(stderr, "[%s@%05d]: %s\n", inet_ntoa(gameInfo->players[i]->clientAddr.sin_addr), ntohs(gameInfo->players[i]->clientAddr.sin_port), goldMessage);
-      message_send(gameInfo->players[i]->clientAddr, goldMessage);      
+  const char *live = gameInfo->map->grids;
+  for (int w=0; w*64<game->numCells; w++) {
+    int begin = w*64;
+    int end = begin+64 < game->numCells ? begin+64 : game->numCells;
+    uint64_t changes = 0;
+    if (memcmp(live+begin, game->lastMap+begin, end-begin) != 0) {
+      for (int i=begin; i<end; i++) {
+        if (live[i] != game->lastMap[i]) {
+          changes |= (uint64_t)1 << (i%64);
+        }
+      }
+      memcpy(game->lastMap+begin, live+begin, end-begin);
     }
+    game->mapChanges[w] = changes;
   }
-  // send new r to spectator
-  if (gameInfo->spectator->connected == true) {
-    sprintf(goldMessage, "GOLD %d %d %d", 0, 0, r);
-    message_send(gameInfo->spectator->clientAddr, goldMessage);
-    fprintf(stderr, "[%s@%05d]: %s\n", inet_ntoa(gameInfo->spectator->clientAddr.sin_addr), ntohs(gameInfo->spectator->clientAddr.sin_port), goldMessage);
+}
+
+
+/* Says whether a player's map differs from the last one they
+ * were sent: their view was recomputed, or a cell they can see
+ * is among game->mapChanges
+ */
+bool viewChanged(playerView_t *view)
+{
+  if (view->changed) {
+    return true;
+  }
+  for (int w=0; w*64<game->numCells; w++) {
+    if (view->visible[w] & game->mapChanges[w]) {
+      return true;
+    }
   }
-  free(goldMessage);
+  return false;
 }
 
 
-/* ********************* sendSummary ********************** */
-/* Sends end game summary to all players after all of the gold has
- * been collected.
+/* ********************* sendFrame ********************** */
+/* Adds one client's map to a broadcast. A client that asked for deltas
+ * gets "DELTA base seq" followed by the cells that differ
+ * from frame base, the newest frame it acknowledged. Each
+ * line of a delta is "row col text": text replaces the
+ * cells starting at that row and column. The client gets
+ * a keyframe, "FRAME seq" and the whole map, instead if it
+ * has acknowledged no frame still in history, if
+ * KeyframeInterval deltas have gone out since the last one,
+ * or if the delta would be longer than the map.
  *
  * Caller provides:
- *   - structure of game information
- *   - current number of players that have connected since the
- *     beginning of the game
+ *   - the broadcast to add to
+ *   - address of client
+ *   - frames sent to that client
+ *   - map string the client should see
+ *   - number of columns in the map
+ *   - buffers of FrameHeaderSize bytes for the header and
+ *     strlen(grid)+1 bytes for a delta, kept with grid until
+ *     the broadcast is flushed
  * We guarantee:
- *   - results are ranked by number of gold nuggets collected
- *   - the summary message is sent to all connected players
- *     and spectator
- *   - even players that have disconnected since the start of
- *     the game are represented in the summary
- *   - memory for the message string is allocated and freed
+ *   - the header and the map or delta go out as they lie
+ *   - the frame is numbered and kept as a base for later deltas
+ *   - a client that asked for tiles gets them from sendTiles
  */
-void sendSummary(gameInfo_t *gameInfo, int numPlayers)
+void sendFrame(broadcast_t *batch, addr_t clientAddr, clientFrames_t *frames, const char *grid, int nC,
+               char *header, char *delta)
 {
-  // rank results in players array by number of nuggets
-  player_t **players = gameInfo->players;
-  player_t *swap = NULL;
-  for (int i=0; i<numPlayers; i++) {
-    for (int j=0; j<numPlayers-1; j++) {
-      if (players[j]->numNugs < players[j+1]->numNugs) {
-        swap = players[j];
-        players[j] = players[j+1];
-        players[j+1] = swap;
-      }
+  if (frames->tiles) {
+    sendTiles(batch, clientAddr, frames, grid, nC);
+    return;
+  }
+  if (!frames->delta) {
+    broadcastAdd(batch, clientAddr, "DISPLAY\n", grid);
+    logEvent(LogDebug, LogText, &clientAddr, "DISPLAY");
+    return;
+  }
+  int len = strlen(grid);
+  int seq = frames->seq+1;
+  int slot = seq%FrameHistory;
+  int base = frames->acked;
+  bool sent = false;
+  // the base must still be in history once this frame replaces the oldest one
+  if (base >= 0 && seq-base < FrameHistory && frames->historySeq[base%FrameHistory] == base
+      && frames->history[base%FrameHistory] != NULL && frames->sinceKeyframe < KeyframeInterval) {
+    if (writeDelta(delta, frames->history[base%FrameHistory], grid, nC, len) >= 0) {
+      int length = 6;
+      memcpy(header, "DELTA ", 6);
+      length += formatInt(header+length, base);
+      header[length++] = ' ';
+      length += formatInt(header+length, seq);
+      header[length++] = '\n';
+      header[length] = '\0';
+      broadcastAdd(batch, clientAddr, header, delta);
+      logEvent(LogDebug, LogText, &clientAddr, header);
+      frames->sinceKeyframe++;
+      sent = true;
     }
   }
-  // construct summary message string
-  int length=0;
-  for (int i=0; i<numPlayers; i++) {
-    length += strlen(players[i]->realname);
-    length += numDigits(players[i]->numNugs);
+  if (!sent) {
+    int length = 6;
+    memcpy(header, "FRAME ", 6);
+    length += formatInt(header+length, seq);
+    header[length++] = '\n';
+    header[length] = '\0';
+    broadcastAdd(batch, clientAddr, header, grid);
+    logEvent(LogDebug, LogText, &clientAddr, header);
+    frames->sinceKeyframe = 0;
   }
-  char *summaryMessage = malloc(10+length+(8*numPlayers));
-  sprintf(summaryMessage, "GAMEOVER\n");
-  for (int i=0; i<numPlayers; i++) {
-    char *temp = malloc(strlen(players[i]->realname)+numDigits(players[i]->numNugs)+8);
-    sprintf(temp, "%d. %c %s %d\n", i+1, players[i]->L, players[i]->realname, players[i]->numNugs);
-    strcat(summaryMessage, temp);
-    free(temp);
+  // remember the frame as a possible base
+  if (frames->history[slot] == NULL) {
+    frames->history[slot] = malloc(len+1);
   }
-  // send summary to all players
-  for (int j=0; j<numPlayers; j++) {
-    if (players[j]->connected == true) {
-      message_send(players[j]->clientAddr, summaryMessage);
+  strcpy(frames->history[slot], grid);
+  frames->historySeq[slot] = seq;
+  frames->seq = seq;
+}
+
+
+/* ********************* writeDelta ********************** */
+/* Writes the cells of grid that differ from base as
+ * "row col text" lines. Changed cells in a row less than
+ * DeltaMergeGap apart share a line.
+ *
+ * Caller provides:
+ *   - buffer of at least limit+1 bytes
+ *   - base and new map strings of the same size
+ *   - number of columns in the map
+ *   - most bytes the delta may take
+ * We return:
+ *   - the length of the delta
+ *   - -1 if it would be longer than limit
+ */
+int writeDelta(char *out, const char *base, const char *grid, int nC, int limit)
+{
+  int size = 0;
+  int i = 0;
+  while (grid[i] != '\0') {
+    if (grid[i] == base[i]) {
+      i++;
+      continue;
     }
+    // extend the run over nearby changes in the same row
+    int start = i;
+    int stop = i+1;  // one past the last changed cell
+    for (int j=stop; grid[j] != '\0' && grid[j] != '\n' && j-stop < DeltaMergeGap; j++) {
+      if (grid[j] != base[j]) {
+        stop = j+1;
+      }
+    }
+    if (size+24+(stop-start) > limit) {  // 24 bytes covers "row col " and the newline
+      return -1;
+    }
+    size += formatInt(out+size, start/(nC+1));
+    out[size++] = ' ';
+    size += formatInt(out+size, start%(nC+1));
+    out[size++] = ' ';
+    memcpy(out+size, grid+start, stop-start);
+    size += stop-start;
+    out[size++] = '\n';
+    i = stop;
   }
-  // send summary to spectator if there is one
-  if (gameInfo->spectator->connected) {
-    message_send(gameInfo->spectator->clientAddr, summaryMessage);
-  }
-  free(summaryMessage);
+  out[size] = '\0';
+  return size;
 }
 
 
-/* ********************* deleteGameInfo ********************** */
-/* Frees the allocated strings and structures in the gameInfo structure
+/* ********************* findClientSlot ********************** */
+/* Finds where a client's frames are kept.
  *
- * Caller provides: 
- *   - pointer to the structure of game information
+ * Caller provides:
+ *   - structure of game information
+ *   - address of client
+ * We return:
+ *   - the player's slot in the players array
+ *   - MaxPlayers for the spectator
+ *   - -1 if the address belongs to no client
  */
-void deleteGameInfo(gameInfo_t *gameInfo)
+int findClientSlot(gameInfo_t *gameInfo, addr_t clientAddr)
 {
-  int i=0;
-  // free the players array
-  while (gameInfo->players[i] != NULL) {
-    free(gameInfo->players[i]->map->grids);
-    free(gameInfo->players[i]->map);
-    free(gameInfo->players[i]->past);
-    free(gameInfo->players[i]->realname);
-    free(gameInfo->players[i]);
-    i++;
+  if (gameInfo->spectator->connected && message_eqAddr(gameInfo->spectator->clientAddr, clientAddr)) {
+    return MaxPlayers;
   }
-  // free the gold bags array
-  for (int j=0; j<gameInfo->GoldNumPiles; j++) {
-    free(gameInfo->goldBags[j]);
+  int slot = lookupSlot(clientAddr);
+  if (slot >= 0 && gameInfo->players[slot]->connected) {
+    return slot;
   }
-  free(gameInfo->goldBags);
-  free(gameInfo->mapRaw->grids);
-  free(gameInfo->mapRaw);
-  free(gameInfo->map->grids);
-  free(gameInfo->map);
-  free(gameInfo->spectator);
-  free(gameInfo);
+  return -1;
 }
 
 
-/* ********************* getColRow ********************** */
+/* ********************* resetClientFrames ********************** */
+/* Frees a client's frame history and returns it to plain
+ * DISPLAY updates.
+ */
+void resetClientFrames(clientFrames_t *frames)
+{
+  for (int i=0; i<FrameHistory; i++) {
+    free(frames->history[i]);
+    frames->history[i] = NULL;
+    frames->historySeq[i] = -1;
+  }
+  frames->delta = false;
+  frames->seq = 0;
+  frames->acked = -1;
+  frames->sinceKeyframe = 0;
+  free(frames->tileMap);
+  free(frames->tileVersions);
+  frames->tileMap = NULL;
+  frames->tileVersions = NULL;
+  frames->tiles = false;
+}
+
+
+/* ********************* startTiles ********************** */
+/* Switches a client to TILE updates, viewing the whole map.
+ * The client starts with a blank map, so tiles it has never
+ * seen anything of are not sent.
+ *
+ * Caller provides:
+ *   - structure of game information
+ *   - the client's frames
+ */
+void startTiles(gameInfo_t *gameInfo, clientFrames_t *frames)
+{
+  int nR = gameInfo->map->nR;
+  int nC = gameInfo->map->nC;
+  resetClientFrames(frames);
+  frames->tiles = true;
+  frames->top = 0;
+  frames->left = 0;
+  frames->rows = nR;
+  frames->cols = nC;
+  frames->tileMap = malloc(game->numCells+1);
+  for (int i=0; i<game->numCells; i++) {
+    frames->tileMap[i] = gameInfo->mapRaw->grids[i]=='\n' ? '\n' : ' ';
+  }
+  frames->tileMap[game->numCells] = '\0';
+  frames->tileVersions = calloc(((nR+TileRows-1)/TileRows)*((nC+TileCols-1)/TileCols), sizeof(int));
+}
+
+
+/* Determines whether the game's map fits in one DISPLAY
+ * message; clients of a larger map are only ever sent tiles
+ */
+bool displayFits(void)
+{
+  return strlen("DISPLAY\n")+game->numCells <= MaxBytes;
+}
+
+
+/* ********************* sendTiles ********************** */
+/* Adds to a broadcast the tiles of a client's map that meet
+ * its viewport and differ from what the client has. The map
+ * is cut into tiles of TileRows rows and TileCols columns, the
+ * last ones in each direction smaller where the map ends. A
+ * tile goes out as "TILE row col version" and its rows, each
+ * ending in a newline: row and col are its top left cell, and
+ * its version goes up by one each time it is sent, so a client
+ * can drop a tile older than one it already has. A TILE
+ * message stays under TileMessageSize bytes however large the
+ * map, so it is never fragmented on the way.
+ *
+ * Caller provides:
+ *   - the broadcast to add to
+ *   - address of client
+ *   - frames sent to that client, in tile mode
+ *   - map string the client should see
+ *   - number of columns in the map
+ * We guarantee:
+ *   - the client's tileMap is brought up to date within its
+ *     viewport
+ *   - the messages are built in the game's tile space, which
+ *     is flushed when full
+ */
+void sendTiles(broadcast_t *batch, addr_t clientAddr, clientFrames_t *frames, const char *grid, int nC)
+{
+  int stride = nC+1;
+  int nR = game->numCells/stride;
+  int tilesAcross = (nC+TileCols-1)/TileCols;
+  // tiles meeting the viewport, clipped to the map
+  int top = frames->top > 0 ? frames->top : 0;
+  int left = frames->left > 0 ? frames->left : 0;
+  int bottom = frames->top+frames->rows < nR ? frames->top+frames->rows : nR;  // one past the last row
+  int right = frames->left+frames->cols < nC ? frames->left+frames->cols : nC;
+  if (top >= bottom || left >= right) {
+    return;
+  }
+  for (int tr=top/TileRows; tr<=(bottom-1)/TileRows; tr++) {
+    for (int tc=left/TileCols; tc<=(right-1)/TileCols; tc++) {
+      int row0 = tr*TileRows;
+      int rowEnd = row0+TileRows < nR ? row0+TileRows : nR;
+      int col0 = tc*TileCols;
+      int width = (col0+TileCols < nC ? col0+TileCols : nC) - col0;
+      int r = row0;
+      while (r < rowEnd && memcmp(grid+r*stride+col0, frames->tileMap+r*stride+col0, width) == 0) {
+        r++;
+      }
+      if (r == rowEnd) {
+        continue;  // the client has this tile
+      }
+      if (game->tileUsed+TileMessageSize > TileSpaceSize) {
+        broadcastFlush(batch);
+        game->tileUsed = 0;
+      }
+      char *message = game->tileSpace+game->tileUsed;
+      int length = 5;
+      memcpy(message, "TILE ", 5);
+      length += formatInt(message+length, row0);
+      message[length++] = ' ';
+      length += formatInt(message+length, col0);
+      message[length++] = ' ';
+      length += formatInt(message+length, ++frames->tileVersions[tr*tilesAcross+tc]);
+      message[length++] = '\n';
+      for (r=row0; r<rowEnd; r++) {
+        memcpy(message+length, grid+r*stride+col0, width);
+        memcpy(frames->tileMap+r*stride+col0, grid+r*stride+col0, width);
+        length += width;
+        message[length++] = '\n';
+      }
+      message[length] = '\0';
+      broadcastAdd(batch, clientAddr, message, NULL);
+      logEvent(LogDebug, LogText, &clientAddr, message);
+      game->tileUsed += length+1;
+    }
+  }
+}
+
+
+/* ********************* goldChanged ********************** */
+/* Records the gold a player picked up and sends gold info to
+ * all players, at once or, in tick mode, when the tick ends.
+ *
+ * Caller provides:
+ *    - structure of game information
+ *    - address of client
+ *    - number of nuggets just picked up by that client, which
+ *      may be 0 when only the client needs gold info
+ */
+void goldChanged(gameInfo_t *gameInfo, addr_t clientAddr, int n)
+{
+  int slot = lookupSlot(clientAddr);
+  if (slot >= 0) {
+    game->goldTaken[slot] += n;
+  }
+  if (tickHz > 0) {
+    game->goldDue = true;
+  } else {
+    sendGoldInfo(gameInfo);
+  }
+}
+
+
+/* Sends the maps at once or, in tick mode, when the tick ends */
+void mapChanged(gameInfo_t *gameInfo)
+{
+  if (tickHz > 0) {
+    game->mapsDue = true;
+  } else {
+    sendMap(gameInfo->map, gameInfo);
+  }
+}
+
+
+/* ********************* sendGoldInfo ********************** */
+/* Sends updated gold info to all players after players pick
+ * up gold bags.
+ *
+ * Caller provides:
+ *    - structure of game information, with the nuggets each
+ *      player picked up in game->goldTaken
+ * We guarantee:
+ *    - the updated n, p, and r is send to the corresponding
+ *      players, in one broadcast
+ *    - game->goldTaken is cleared
+ */
+void sendGoldInfo(gameInfo_t *gameInfo)
+{
+  int r;  // number of gold nuggets remainin
+  char goldMessage[BroadcastCopySize];  // string with gold info to be sent to client
+  broadcast_t batch = {.count = 0};  // players with the same purse share a message
+  r = gameInfo->totalGold;
+  for (int i=0; i<gameInfo->numPlayers; i++) {
+    // send n, p, r to each player, n being what they just picked up
+    int n = game->goldTaken[i];
+    game->goldTaken[i] = 0;
+    if (gameInfo->players[i]->connected == true) {
+      formatGold(goldMessage, n, gameInfo->players[i]->numNugs, r);
+      logGold(LogInfo, &gameInfo->players[i]->clientAddr, n, gameInfo->players[i]->numNugs, r);
+      broadcastCopy(&batch, gameInfo->players[i]->clientAddr, goldMessage);
+    }
+  }
+  // send new r to spectator
+  if (gameInfo->spectator->connected == true) {
+    formatGold(goldMessage, 0, 0, r);
+    broadcastCopy(&batch, gameInfo->spectator->clientAddr, goldMessage);
+    logGold(LogInfo, &gameInfo->spectator->clientAddr, 0, 0, r);
+  }
+  broadcastFlush(&batch);
+}
+
+
+/* ********************* formatGold ********************** */
+/* Writes "GOLD n p r" to out, which has room for
+ * BroadcastCopySize bytes, and returns its length.
+ */
+int formatGold(char *out, int n, int p, int r)
+{
+  int length = 5;
+  memcpy(out, "GOLD ", 5);
+  length += formatInt(out+length, n);
+  out[length++] = ' ';
+  length += formatInt(out+length, p);
+  out[length++] = ' ';
+  length += formatInt(out+length, r);
+  out[length] = '\0';
+  return length;
+}
+
+
+/* ********************* sendSummary ********************** */
+/* Sends end game summary to all players after all of the gold has
+ * been collected.
+ *
+ * Caller provides:
+ *   - structure of game information
+ *   - current number of players that have connected since the
+ *     beginning of the game
+ * We guarantee:
+ *   - results are ranked by number of gold nuggets collected
+ *   - the summary message is sent to all connected players
+ *     and spectator
+ *   - even players that have disconnected since the start of
+ *     the game are represented in the summary
+ *   - the message is written once, line after line, into one
+ *     buffer that is then freed
+ */
+void sendSummary(gameInfo_t *gameInfo, int numPlayers)
+{
+  // rank results in players array by number of nuggets
+  player_t **players = gameInfo->players;
+  player_t *swap = NULL;
+  for (int i=0; i<numPlayers; i++) {
+    for (int j=0; j<numPlayers-1; j++) {
+      if (players[j]->numNugs < players[j+1]->numNugs) {
+        swap = players[j];
+        players[j] = players[j+1];
+        players[j+1] = swap;
+      }
+    }
+  }
+  // construct summary message string, 28 bytes covering each line's numbers, spaces and letter
+  int size = 10;
+  for (int i=0; i<numPlayers; i++) {
+    size += strlen(players[i]->realname)+28;
+  }
+  char *summaryMessage = malloc(size);
+  int length = 9;
+  memcpy(summaryMessage, "GAMEOVER\n", 9);
+  for (int i=0; i<numPlayers; i++) {
+    int nameLength = strlen(players[i]->realname);
+    length += formatInt(summaryMessage+length, i+1);
+    summaryMessage[length++] = '.';
+    summaryMessage[length++] = ' ';
+    summaryMessage[length++] = players[i]->L;
+    summaryMessage[length++] = ' ';
+    memcpy(summaryMessage+length, players[i]->realname, nameLength);
+    length += nameLength;
+    summaryMessage[length++] = ' ';
+    length += formatInt(summaryMessage+length, players[i]->numNugs);
+    summaryMessage[length++] = '\n';
+  }
+  summaryMessage[length] = '\0';
+  // send summary to all players, everyone sharing the one message
+  broadcast_t batch = {.count = 0};
+  for (int j=0; j<numPlayers; j++) {
+    if (players[j]->connected == true) {
+      broadcastAdd(&batch, players[j]->clientAddr, summaryMessage, NULL);
+    }
+  }
+  // send summary to spectator if there is one
+  if (gameInfo->spectator->connected) {
+    broadcastAdd(&batch, gameInfo->spectator->clientAddr, summaryMessage, NULL);
+  }
+  broadcastFlush(&batch);
+  free(summaryMessage);
+}
+
+
+/* ********************* sightNew ********************** */
+/* Builds the sight tables for a map from its bare map string,
+ * and reports how long that took and how much memory the
+ * tables use. Walls never move, so every later view is a
+ * lookup. Only the main thread builds tables, before any game
+ * is played on them.
+ *
+ * Caller provides:
+ *   - the bare map string, which stays the caller's
+ * We return:
+ *   - the tables, for sightDelete to free after the last game
+ *     on the map
+ * We guarantee:
+ *   - every room spot and passage cell has its runs of
+ *     cells in sight; any other cell has none
+ */
+sight_t *sightNew(char *gridRaw)
+{
+  map_t mapRaw = {.grids = gridRaw};
+  getColRow(gridRaw, &mapRaw.nC, &mapRaw.nR);
+  int stride = mapRaw.nC+1;
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  sight_t *sight = malloc(sizeof(sight_t));
+  sight->numCells = mapRaw.nR*stride;
+  int *cells = malloc(sizeof(int)*sight->numCells);
+  int *queue = malloc(sizeof(int)*sight->numCells);
+  uint64_t *queued = calloc((sight->numCells+63)/64, sizeof(uint64_t));
+  uint64_t *inSight = calloc((sight->numCells+63)/64, sizeof(uint64_t));
+  int capacity = sight->numCells;
+  // prefix sums of non-room cells let lineOfSight pass open rooms at once
+  blockedSums = calloc((mapRaw.nR+1)*(stride+1), sizeof(int));
+  for (int y=0; y<mapRaw.nR; y++) {
+    for (int x=0; x<stride; x++) {
+      blockedSums[(y+1)*(stride+1)+x+1] = blockedSums[y*(stride+1)+x+1] + blockedSums[(y+1)*(stride+1)+x]
+        - blockedSums[y*(stride+1)+x] + (mapRaw.grids[y*stride+x] != '.');
+    }
+  }
+  sight->first = malloc(sizeof(int)*(sight->numCells+1));
+  sight->runs = malloc(sizeof(sightRun_t)*capacity);
+  sight->numRuns = 0;
+  for (int c=0; c<sight->numCells; c++) {
+    sight->first[c] = sight->numRuns;
+    char spot = mapRaw.grids[c];
+    if (spot != '.' && spot != '#') {
+      continue;  // nobody stands here
+    }
+    int n = scanSight(&mapRaw, c%stride, c/stride, cells, queue, queued);
+    // mark the cells, then read the marks back in order
+    int low = c;
+    int high = c;
+    for (int i=0; i<n; i++) {
+      inSight[cells[i]/64] |= (uint64_t)1 << (cells[i]%64);
+      low = cells[i] < low ? cells[i] : low;
+      high = cells[i] > high ? cells[i] : high;
+    }
+    int last = -2;
+    for (int w=low/64; w<=high/64; w++) {
+      uint64_t bits = inSight[w];
+      inSight[w] = 0;
+      while (bits != 0) {
+        int cell = w*64+__builtin_ctzll(bits);
+        bits &= bits-1;
+        // consecutive offsets are neighbours in a row, since newlines are never in sight
+        if (cell == last+1) {
+          sight->runs[sight->numRuns-1].length++;
+        } else {
+          if (sight->numRuns == capacity) {
+            capacity *= 2;
+            sight->runs = realloc(sight->runs, sizeof(sightRun_t)*capacity);
+          }
+          sight->runs[sight->numRuns].start = cell;
+          sight->runs[sight->numRuns].length = 1;
+          sight->numRuns++;
+        }
+        last = cell;
+      }
+    }
+  }
+  sight->first[sight->numCells] = sight->numRuns;
+  sight->runs = realloc(sight->runs, sizeof(sightRun_t)*(sight->numRuns > 0 ? sight->numRuns : 1));
+  free(cells);
+  free(queue);
+  free(queued);
+  free(inSight);
+  free(blockedSums);
+  blockedSums = NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ms = (end.tv_sec-begin.tv_sec)*1e3 + (end.tv_nsec-begin.tv_nsec)/1e6;
+  long bytes = sizeof(int)*(sight->numCells+1) + sizeof(sightRun_t)*(long)sight->numRuns;
+  printf("sight tables: %d cells, %d runs, %ld bytes, built in %.1f ms\n", sight->numCells, sight->numRuns, bytes, ms);
+  return sight;
+}
+
+
+/* Frees a map's sight tables once no game is played on them */
+void sightDelete(sight_t *sight)
+{
+  free(sight->first);
+  free(sight->runs);
+  free(sight);
+}
+
+
+/* ********************* viewsInit ********************** */
+/* Makes room for a game's views, frames and tiles once gridInit
+ * has sized the map, and keeps a copy of the map to find
+ * changes against.
+ *
+ * Caller provides:
+ *   - structure of game information, with the grid sized
+ */
+void viewsInit(gameInfo_t *gameInfo)
+{
+  game->numCells = gameInfo->mapRaw->nR*(gameInfo->mapRaw->nC+1);
+  game->frameStride = FrameHeaderSize + 2*(game->numCells+1);
+  game->frameSpace = malloc(game->frameStride*(MaxPlayers+1));
+  game->tileSpace = malloc(TileSpaceSize);
+  game->lastMap = malloc(game->numCells+1);
+  strcpy(game->lastMap, gameInfo->map->grids);
+  game->mapChanges = calloc((game->numCells+63)/64, sizeof(uint64_t));
+}
+
+
+/* ********************* scanSight ********************** */
+/* Finds the cells in sight from (px, py) on the bare map.
+ * The search starts there and only spreads from room spots
+ * in sight, so it looks at the room and the cells bordering
+ * it rather than the whole map.
+ *
+ * Caller provides:
+ *   - the bare map
+ *   - a position on it
+ *   - room for every cell of the map in cells and queue
+ *   - a cleared bitset of every cell in queued, which is
+ *     cleared again on return
+ * We return:
+ *   - the number of cells in sight, stored in cells
+ */
+int scanSight(map_t *mapRaw, int px, int py, int *cells, int *queue, uint64_t *queued)
+{
+  int nC = mapRaw->nC;
+  int nR = mapRaw->nR;
+  int stride = nC+1;
+  int start = py*stride+px;
+  int n = 0;
+  int head = 0;
+  int tail = 0;
+  queue[tail++] = start;
+  queued[start/64] |= (uint64_t)1 << (start%64);
+  while (head < tail) {
+    int cell = queue[head++];
+    int x = cell%stride;
+    int y = cell/stride;
+    if (cell != start && !lineOfSight(mapRaw, px, py, x, y)) {
+      continue;
+    }
+    cells[n++] = cell;
+    // sight carries on across room spots only
+    if (cell != start && !isRoomSpot(mapRaw, x, y)) {
+      continue;
+    }
+    for (int dy=-1; dy<=1; dy++) {
+      for (int dx=-1; dx<=1; dx++) {
+        int nx = x+dx;
+        int ny = y+dy;
+        int next = ny*stride+nx;
+        if (nx>=0 && nx<nC && ny>=0 && ny<nR && !(queued[next/64] & ((uint64_t)1 << (next%64)))) {
+          queued[next/64] |= (uint64_t)1 << (next%64);
+          queue[tail++] = next;
+        }
+      }
+    }
+  }
+  for (int i=0; i<tail; i++) {
+    queued[queue[i]/64] &= ~((uint64_t)1 << (queue[i]%64));
+  }
+  return n;
+}
+
+
+/* ********************* refreshViews ********************** */
+/* Brings every player's view up to date after moves, joins
+ * and quits. This replaces the full updateVisibility sweep:
+ * only players whose position changed have their line of
+ * sight recomputed. Nothing is drawn here; what others see
+ * of a move comes from the game's map when maps are sent.
+ *
+ * Caller provides:
+ *   - structure of game information, with the moves made
+ */
+void refreshViews(gameInfo_t *gameInfo)
+{
+  for (int j=0; j<gameInfo->numPlayers; j++) {
+    player_t *player = gameInfo->players[j];
+    playerView_t *view = &game->playerViews[j];
+    if (player == NULL) {
+      continue;
+    }
+    if (!player->connected) {
+      view->active = false;
+    } else if (!view->active || player->x != view->x || player->y != view->y) {
+      computeView(gameInfo, view, player);
+    }
+  }
+}
+
+
+/* ********************* computeView ********************** */
+/* Looks up which cells a player can see from where they
+ * stand and marks them seen.
+ *
+ * Caller provides:
+ *   - structure of game information
+ *   - the player's view, which is built on first use
+ *   - the player, who is on the board
+ */
+void computeView(gameInfo_t *gameInfo, playerView_t *view, player_t *player)
+{
+  int stride = gameInfo->map->nC+1;
+  int words = (game->numCells+63)/64;
+  if (!view->active) {
+    // a new player has seen nothing yet
+    if (view->visible == NULL) {
+      view->visible = calloc(words, sizeof(uint64_t));
+      view->seen = calloc(words, sizeof(uint64_t));
+    } else {
+      memset(view->seen, 0, sizeof(uint64_t)*words);
+    }
+    view->active = true;
+  }
+  memset(view->visible, 0, sizeof(uint64_t)*words);
+  view->x = player->x;
+  view->y = player->y;
+  view->changed = true;
+
+  // the table has nothing for a cell nobody should stand on, so it sees only itself
+  int start = player->y*stride+player->x;
+  const sight_t *sight = game->sight;
+  if (sight->first[start] == sight->first[start+1]) {
+    markRun(view->visible, start, 1);
+  }
+  for (int r=sight->first[start]; r<sight->first[start+1]; r++) {
+    markRun(view->visible, sight->runs[r].start, sight->runs[r].length);
+  }
+  for (int w=0; w<words; w++) {
+    view->seen[w] |= view->visible[w];
+  }
+}
+
+
+/* Sets length bits of a bitset from bit start on, a word at a time */
+void markRun(uint64_t *bits, int start, int length)
+{
+  int stop = start+length;
+  while (start < stop) {
+    int count = 64-start%64 < stop-start ? 64-start%64 : stop-start;
+    uint64_t mask = count == 64 ? ~(uint64_t)0 : (((uint64_t)1 << count)-1) << (start%64);
+    bits[start/64] |= mask;
+    start += count;
+  }
+}
+
+
+/* ********************* renderView ********************** */
+/* Draws a player's map: @ where the player stands, the live
+ * map where they can see, the bare map where they only
+ * remember, and a space elsewhere.
+ *
+ * Caller provides:
+ *   - structure of game information
+ *   - the player's view, built
+ *   - room for the map string in out
+ */
+void renderView(gameInfo_t *gameInfo, playerView_t *view, char *out)
+{
+  const char *live = gameInfo->map->grids;
+  const char *raw = gameInfo->mapRaw->grids;
+  for (int w=0; w*64<game->numCells; w++) {
+    int end = (w+1)*64 < game->numCells ? (w+1)*64 : game->numCells;
+    uint64_t visible = view->visible[w];
+    uint64_t seen = view->seen[w];
+    for (int i=w*64; i<end; i++) {
+      uint64_t bit = (uint64_t)1 << (i%64);
+      out[i] = (visible & bit) ? live[i] : (seen & bit) ? raw[i] : raw[i]=='\n' ? '\n' : ' ';
+    }
+  }
+  out[view->y*(gameInfo->map->nC+1)+view->x] = '@';
+  out[game->numCells] = '\0';
+}
+
+
+/* ********************* lineOfSight ********************** */
+/* Determines whether a player at (px, py) can see (tx, ty).
+ * Every column and row strictly between the two is checked
+ * where the straight line crosses it: the cell there must be
+ * a room spot, or where the line passes between two cells,
+ * at least one of them must be.
+ *
+ * We return:
+ *   - true if nothing blocks the line
+ */
+bool lineOfSight(map_t *mapRaw, int px, int py, int tx, int ty)
+{
+  int dx = tx-px;
+  int dy = ty-py;
+  int x0 = px < tx ? px : tx;
+  int x1 = px < tx ? tx : px;
+  int y0 = py < ty ? py : ty;
+  int y1 = py < ty ? ty : py;
+  // every cell checked below lies in one of these two boxes
+  if (isOpenBox(mapRaw, x0+1, y0, x1-1, y1) && isOpenBox(mapRaw, x0, y0+1, x1, y1-1)) {
+    return true;
+  }
+  for (int x=px+(dx>0 ? 1 : -1); dx!=0 && x!=tx; x+=(dx>0 ? 1 : -1)) {
+    int num = dy*(x-px);  // the line crosses column x at row py + num/dx
+    int y = py+num/dx-((num%dx != 0) && ((num < 0) != (dx < 0)));  // rounded down
+    if (num%dx == 0 ? !isRoomSpot(mapRaw, x, y) : !isRoomSpot(mapRaw, x, y) && !isRoomSpot(mapRaw, x, y+1)) {
+      return false;
+    }
+  }
+  for (int y=py+(dy>0 ? 1 : -1); dy!=0 && y!=ty; y+=(dy>0 ? 1 : -1)) {
+    int num = dx*(y-py);
+    int x = px+num/dy-((num%dy != 0) && ((num < 0) != (dy < 0)));
+    if (num%dy == 0 ? !isRoomSpot(mapRaw, x, y) : !isRoomSpot(mapRaw, x, y) && !isRoomSpot(mapRaw, x+1, y)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+/* Determines whether a cell of the bare map is a room spot, which sight passes over */
+bool isRoomSpot(map_t *mapRaw, int x, int y)
+{
+  return mapRaw->grids[y*(mapRaw->nC+1)+x] == '.';
+}
+
+
+/* Determines whether every cell from (x0, y0) to (x1, y1) is a
+ * room spot. An empty box is open; without the sums built by
+ * sightNew no box is.
+ */
+bool isOpenBox(map_t *mapRaw, int x0, int y0, int x1, int y1)
+{
+  int w = mapRaw->nC+2;
+  if (x0 > x1 || y0 > y1) {
+    return true;
+  }
+  if (blockedSums == NULL) {
+    return false;
+  }
+  return blockedSums[(y1+1)*w+x1+1] - blockedSums[y0*w+x1+1] - blockedSums[(y1+1)*w+x0] + blockedSums[y0*w+x0] == 0;
+}
+
+
+/* ********************* deleteViews ********************** */
+/* Frees the views, the frame and tile space and the copy of
+ * the map changes are found against; the sight tables are the
+ * map's, not the game's
+ */
+void deleteViews(void)
+{
+  for (int j=0; j<MaxPlayers; j++) {
+    free(game->playerViews[j].visible);
+    free(game->playerViews[j].seen);
+  }
+  free(game->frameSpace);
+  free(game->lastMap);
+  free(game->tileSpace);
+  free(game->mapChanges);
+}
+
+
+/* ********************* occupantsInit ********************** */
+/* Builds the occupancy grid once randomizeNuggets has placed
+ * the gold. Players are added as they join (indexPlayer) and
+ * kept in place as they move (trackMove) and quit.
+ *
+ * Caller provides:
+ *   - structure of game information, with the gold bags
+ */
+void occupantsInit(gameInfo_t *gameInfo)
+{
+  int stride = gameInfo->map->nC+1;
+  int size = gameInfo->map->nR*stride;
+  game->occupants = malloc(sizeof(occupant_t)*size);
+  for (int i=0; i<size; i++) {
+    game->occupants[i].bag = -1;
+    game->occupants[i].player = -1;
+  }
+  for (int j=0; j<gameInfo->GoldNumPiles; j++) {
+    game->occupants[gameInfo->goldBags[j]->y*stride+gameInfo->goldBags[j]->x].bag = j;
+  }
+}
+
+
+/* Hashes an IP address and port to an entry of an address
+ * index of 1<<bits entries
+ */
+int hashAddr(addr_t addr, int bits)
+{
+  uint32_t key = (uint32_t)addr.sin_addr.s_addr ^ ((uint32_t)addr.sin_port << 16 | addr.sin_port);
+  return (key*2654435761u) >> (32-bits);
+}
+
+
+/* ********************* indexPlayer ********************** */
+/* Adds a player who just joined to the address index and to
+ * the occupancy grid where randomizeOnePlayerLoc put them.
+ * The index holds at most MaxPlayers entries, so it never
+ * fills up.
+ */
+void indexPlayer(gameInfo_t *gameInfo, int slot)
+{
+  player_t *player = gameInfo->players[slot];
+  int i = hashAddr(player->clientAddr, AddrIndexBits);
+  while (game->addrIndex[i].used && !message_eqAddr(game->addrIndex[i].addr, player->clientAddr)) {
+    i = (i+1) & ((1<<AddrIndexBits)-1);
+  }
+  game->addrIndex[i].used = true;
+  game->addrIndex[i].addr = player->clientAddr;
+  game->addrIndex[i].slot = slot;
+  game->occupants[player->y*(gameInfo->map->nC+1)+player->x].player = slot;
+}
+
+
+/* ********************* lookupSlot ********************** */
+/* Finds a player by address, whether or not they are still
+ * connected.
+ *
+ * We return:
+ *   - the player's slot in the players array
+ *   - -1 if no player has that address
+ */
+int lookupSlot(addr_t clientAddr)
+{
+  int i = hashAddr(clientAddr, AddrIndexBits);
+  while (game->addrIndex[i].used) {
+    if (message_eqAddr(game->addrIndex[i].addr, clientAddr)) {
+      return game->addrIndex[i].slot;
+    }
+    i = (i+1) & ((1<<AddrIndexBits)-1);
+  }
+  return -1;
+}
+
+
+/* Finds a player by address; NULL if no player has it */
+player_t *lookupPlayer(gameInfo_t *gameInfo, addr_t clientAddr)
+{
+  int slot = lookupSlot(clientAddr);
+  return slot >= 0 ? gameInfo->players[slot] : NULL;
+}
+
+
+/* ********************* trackMove ********************** */
+/* Follows a move made by movePlayer in the occupancy grid.
+ * If the player swapped places with another, that player now
+ * stands on the cell the mover left.
+ *
+ * Caller provides:
+ *   - structure of game information, after movePlayer
+ *   - slot of the player who moved
+ *   - cell they moved from
+ */
+void trackMove(gameInfo_t *gameInfo, int slot, int from)
+{
+  player_t *player = gameInfo->players[slot];
+  int to = player->y*(gameInfo->map->nC+1)+player->x;
+  int other = game->occupants[to].player;
+  game->occupants[from].player = (other >= 0 && other != slot) ? other : -1;
+  game->occupants[to].player = slot;
+}
+
+
+/* ********************* takeGoldBag ********************** */
+/* Finds the gold bag on the cell a player just moved to,
+ * gameInfo->x and gameInfo->y, and takes it off the grid.
+ *
+ * We return:
+ *   - the gold bag, or NULL if there is none on the cell
+ */
+goldBag_t *takeGoldBag(gameInfo_t *gameInfo)
+{
+  int cell = gameInfo->y*(gameInfo->map->nC+1)+gameInfo->x;
+  int bag = game->occupants[cell].bag;
+  game->occupants[cell].bag = -1;
+  return bag >= 0 ? gameInfo->goldBags[bag] : NULL;
+}
+
+
+/* *************** runGames *************** */
+/* Hosts many games in one process:
+ *
+ *   ./server -games N [-workers W] [-port P] [-seed S] [-tick hz] mapFile...
+ *
+ * Game g is played on the g-th map file, going round the list,
+ * and is seeded with S+g if a seed is given. The games are
+ * shared out among W worker threads (1 by default), and worker
+ * w listens on port P+w, or on any free port if P is not given.
+ * Clients name a game in their handshake, "GAME g PLAY name" or
+ * "GAME g SPECTATE", on the port of its worker; the rest of
+ * their messages are routed by their address. When a game ends
+ * it is torn down and a new one takes its place. With -tick,
+ * each worker runs its games in tick mode (see runTick). The
+ * server stops on SIGINT or SIGTERM.
+ *
+ * We return:
+ *   - 0 once stopped
+ *   - 1 for a bad call or a socket that cannot be opened
+ *   - 2 for an invalid map file
+ */
+int runGames(int argc, char *argv[])
+{
+  int basePort = 0;
+  int i;
+  numWorkers = 1;
+  for (i=1; i+1<argc && argv[i][0]=='-'; i+=2) {
+    int value = atoi(argv[i+1]);
+    if (!isNum(argv[i+1]) || argv[i+1][0]=='\0') {
+      break;
+    } else if (strcmp(argv[i], "-games")==0) {
+      numGames = value;
+    } else if (strcmp(argv[i], "-workers")==0) {
+      numWorkers = value;
+    } else if (strcmp(argv[i], "-port")==0) {
+      basePort = value;
+    } else if (strcmp(argv[i], "-seed")==0) {
+      seeded = true;
+      baseSeed = value;
+    } else if (strcmp(argv[i], "-tick")==0) {
+      tickHz = value;
+    } else {
+      break;
+    }
+  }
+  if (numGames < 1 || numWorkers < 1 || tickHz > MaxTickHz || i >= argc || argv[i][0]=='-') {
+    printf("usage: ./server -games N [-workers W] [-port P] [-seed S] [-tick hz] mapFile...\n");
+    fprintf(stderr, "usage: ./server -games N [-workers W] [-port P] [-seed S] [-tick hz] mapFile...\n");
+    return 1;
+  }
+  numWorkers = numWorkers < numGames ? numWorkers : numGames;
+  numWorkers = numWorkers < MaxWorkers ? numWorkers : MaxWorkers;
+
+  // READ THE MAPS ONCE
+  int status = 0;
+  numMaps = argc-i;
+  mapTexts = calloc(numMaps, sizeof(char *));
+  mapSights = calloc(numMaps, sizeof(sight_t *));
+  for (int m=0; m<numMaps && status==0; m++) {
+    FILE *fp = fopen(argv[i+m], "r");
+    if (fp == NULL) {
+      printf("%s is not a readable file\n", argv[i+m]);
+      fprintf(stderr, "%s is not a readable file\n", argv[i+m]);
+      status = 2;
+    } else {
+      mapTexts[m] = freadfilep(fp);
+      fclose(fp);
+    }
+  }
+
+  // BUILD EACH MAP'S SIGHT TABLES ONCE, FOR ALL ITS GAMES
+  for (int m=0; m<numMaps && status==0; m++) {
+    mapSights[m] = sightNew(mapTexts[m]);
+  }
+  if (!seeded) {
+    baseSeed = time(NULL);
+  }
+
+  // OPEN THE WORKERS' SOCKETS AND START THEIR GAMES
+  worker_t *workers = NULL;
+  if (status == 0) {
+    loggerInit();
+    stopEvent = eventfd(0, 0);
+    workers = calloc(numWorkers, sizeof(worker_t));
+    for (int w=0; w<numWorkers; w++) {
+      workers[w].socket = -1;  // none open yet
+    }
+  }
+  for (int w=0; w<numWorkers && status==0; w++) {
+    worker_t *worker = &workers[w];
+    int gamesHere = (numGames-w+numWorkers-1)/numWorkers;
+    struct sockaddr_in address = {0};
+    socklen_t length = sizeof(address);
+    worker->id = w;
+    worker->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(basePort > 0 ? basePort+w : 0);
+    if (worker->socket < 0 || bind(worker->socket, (struct sockaddr *)&address, sizeof(address)) != 0) {
+      fprintf(stderr, "worker %d: cannot open port %d\n", w, basePort > 0 ? basePort+w : 0);
+      status = 1;
+      continue;
+    }
+    getsockname(worker->socket, (struct sockaddr *)&address, &length);
+    worker->port = ntohs(address.sin_port);
+    // room for every client its games can have, at most half full
+    for (worker->routeBits=6; (1<<worker->routeBits) < 4*gamesHere*(MaxPlayers+1); worker->routeBits++) {
+    }
+    worker->routes = calloc(1<<worker->routeBits, sizeof(addrEntry_t));
+    worker->games = malloc(sizeof(game_t *)*gamesHere);
+    for (int g=w; g<numGames; g+=numWorkers) {
+      worker->games[g/numWorkers] = gameStart(g);
+      printf("game %d: ready at port '%d'\n", g, worker->port);
+    }
+  }
+
+  // RUN UNTIL SIGINT OR SIGTERM
+  if (status == 0) {
+    fflush(stdout);  // clients may be waiting for the ports
+    sigset_t signals;
+    int signal;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);  // the workers inherit this
+    for (int w=0; w<numWorkers; w++) {
+      pthread_create(&workers[w].thread, NULL, workerRun, &workers[w]);
+    }
+    sigwait(&signals, &signal);
+    uint64_t one = 1;
+    if (write(stopEvent, &one, sizeof(one)) != sizeof(one)) {
+      fprintf(stderr, "cannot stop the workers\n");
+    }
+    for (int w=0; w<numWorkers; w++) {
+      pthread_join(workers[w].thread, NULL);
+    }
+    printf("broadcast: %ld datagrams in %ld system calls, %ld saved, %ld dropped\n",
+           broadcastDatagrams, broadcastCalls, broadcastDatagrams-broadcastCalls, broadcastDropped);
+    printf("maps: %ld sent, %ld skipped as unchanged\n", mapsSent, mapsSkipped);
+  }
+
+  // SHUT DOWN SERVER AND FREE MEMORY, HOWEVER FAR IT GOT
+  if (workers != NULL) {
+    for (int w=0; w<numWorkers; w++) {
+      if (workers[w].games != NULL) {  // its games all started
+        for (int g=w; g<numGames; g+=numWorkers) {
+          gameDelete(workers[w].games[g/numWorkers]);
+        }
+      }
+      free(workers[w].games);
+      free(workers[w].routes);
+      if (workers[w].socket >= 0) {
+        close(workers[w].socket);
+      }
+    }
+    loggerDone();
+    close(stopEvent);
+    free(workers);
+  }
+  for (int m=0; m<numMaps; m++) {
+    free(mapTexts[m]);
+    if (mapSights[m] != NULL) {
+      sightDelete(mapSights[m]);
+    }
+  }
+  free(mapTexts);
+  free(mapSights);
+  return status;
+}
+
+
+/* Creates game g of a multi-game server from its map and the
+ * sight tables already built for it. Given a seed, game g is
+ * seeded with it plus g, so it plays the same every time it is
+ * started; otherwise every game started gets a seed of its own.
+ */
+game_t *gameStart(int g)
+{
+  char *gridRaw = malloc(strlen(mapTexts[g%numMaps])+1);
+  strcpy(gridRaw, mapTexts[g%numMaps]);
+  unsigned int seed = seeded ? baseSeed+g : baseSeed+atomic_fetch_add(&gamesStarted, 1);
+  return gameNew(gridRaw, g, mapSights[g%numMaps], seed);
+}
+
+
+/* ********************* workerRun ********************** */
+/* A worker thread: waits on its socket and the stop event
+ * with epoll, and hands each datagram that arrives to the game
+ * it is for. In tick mode it also wakes for the next tick and
+ * runs it for all of its games.
+ */
+void *workerRun(void *arg)
+{
+  worker_t *worker = arg;
+  char *message = malloc(MaxBytes+1);
+  int poll = epoll_create1(0);
+  struct epoll_event event = {.events = EPOLLIN};
+  event.data.fd = worker->socket;
+  epoll_ctl(poll, EPOLL_CTL_ADD, worker->socket, &event);
+  event.data.fd = stopEvent;
+  epoll_ctl(poll, EPOLL_CTL_ADD, stopEvent, &event);
+  messageSocket = worker->socket;
+  workerSocket = worker->socket;
+  bool stopping = false;
+  clock_gettime(CLOCK_MONOTONIC, &nextTick);
+  while (!stopping) {
+    struct epoll_event ready[2];
+    int wait = -1;
+    if (tickHz > 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long long nanos = (nextTick.tv_sec-now.tv_sec)*1000000000LL + (nextTick.tv_nsec-now.tv_nsec);
+      wait = nanos > 0 ? (int)((nanos+999999)/1000000) : 0;  // round up to the millisecond
+    }
+    int n = epoll_wait(poll, ready, 2, wait);
+    for (int i=0; i<n; i++) {
+      if (ready[i].data.fd == stopEvent) {
+        stopping = true;
+        continue;
+      }
+      // take every datagram waiting
+      addr_t from;
+      socklen_t length = sizeof(from);
+      ssize_t size;
+      while ((size = recvfrom(worker->socket, message, MaxBytes, MSG_DONTWAIT,
+                              (struct sockaddr *)&from, &length)) >= 0) {
+        message[size] = '\0';
+        workerDispatch(worker, from, message);
+        length = sizeof(from);
+      }
+    }
+    if (tickHz > 0 && tickDue()) {
+      for (int g=worker->id; g<numGames; g+=numWorkers) {
+        game = worker->games[g/numWorkers];
+        if (runTick(game->gameInfo)) {
+          workerReplace(worker, g);
+        }
+      }
+    }
+  }
+  close(poll);
+  free(message);
+  return NULL;
+}
+
+
+/* ********************* workerDispatch ********************** */
+/* Hands a datagram to the game it is for. A handshake names
+ * its game after "GAME", or joins the worker's first game if it
+ * does not; anything else goes to the game the sender joined.
+ * A game that ends is replaced by a new one.
+ *
+ * Caller provides:
+ *   - the worker the datagram came to
+ *   - address of client
+ *   - message (string)
+ */
+void workerDispatch(worker_t *worker, addr_t from, const char *message)
+{
+  int g = -1;
+  if (strncmp(message, "GAME ", 5)==0) {
+    char *rest;
+    long id = strtol(message+5, &rest, 10);
+    if (rest == message+5 || *rest != ' ' || id < 0 || id >= numGames || id%numWorkers != worker->id) {
+      sendMessage(from, "NO No such game at this port");
+      return;
+    }
+    g = id;
+    message = rest+1;
+  }
+  bool handshake = strcmp(message, "SPECTATE")==0 || strncmp(message, "PLAY", 4)==0;
+  if (g < 0) {
+    g = handshake ? worker->id : routeLookup(worker, from);
+  }
+  if (g < 0) {
+    return;  // not in any game
+  }
+  if (handshake) {
+    routeAdd(worker, from, g);
+  }
+  game = worker->games[g/numWorkers];
+  if (handleMessage(game->gameInfo, from, message)) {
+    workerReplace(worker, g);
+  }
+}
+
+
+/* A worker's game g is over: start a new one in its place */
+void workerReplace(worker_t *worker, int g)
+{
+  gameDelete(worker->games[g/numWorkers]);
+  worker->games[g/numWorkers] = gameStart(g);
+  routeRebuild(worker, g);
+}
+
+
+/* Finds the game a client joined; -1 if none */
+int routeLookup(worker_t *worker, addr_t from)
+{
+  int i = hashAddr(from, worker->routeBits);
+  while (worker->routes[i].used) {
+    if (message_eqAddr(worker->routes[i].addr, from)) {
+      return worker->routes[i].slot;
+    }
+    i = (i+1) & ((1<<worker->routeBits)-1);
+  }
+  return -1;
+}
+
+
+/* Routes a client's messages to game g from now on */
+void routeAdd(worker_t *worker, addr_t from, int g)
+{
+  if (2*(worker->numRoutes+1) > (1<<worker->routeBits)) {
+    routeRebuild(worker, -1);
+  }
+  int i = hashAddr(from, worker->routeBits);
+  while (worker->routes[i].used && !message_eqAddr(worker->routes[i].addr, from)) {
+    i = (i+1) & ((1<<worker->routeBits)-1);
+  }
+  if (!worker->routes[i].used) {
+    worker->numRoutes++;
+  }
+  worker->routes[i].used = true;
+  worker->routes[i].addr = from;
+  worker->routes[i].slot = g;
+}
+
+
+/* ********************* routeRebuild ********************** */
+/* Rebuilds a worker's routes, keeping only clients still
+ * connected to their game.
+ *
+ * Caller provides:
+ *   - the worker
+ *   - a game whose clients all go, as it has just been
+ *     replaced, or -1
+ */
+void routeRebuild(worker_t *worker, int dropGame)
+{
+  int size = 1<<worker->routeBits;
+  addrEntry_t *old = worker->routes;
+  game_t *current = game;
+  worker->routes = calloc(size, sizeof(addrEntry_t));
+  worker->numRoutes = 0;
+  for (int i=0; i<size; i++) {
+    if (!old[i].used || old[i].slot == dropGame) {
+      continue;
+    }
+    game = worker->games[old[i].slot/numWorkers];
+    if (findClientSlot(game->gameInfo, old[i].addr) >= 0) {
+      int j = hashAddr(old[i].addr, worker->routeBits);
+      while (worker->routes[j].used) {
+        j = (j+1) & (size-1);
+      }
+      worker->routes[j] = old[i];
+      worker->numRoutes++;
+    }
+  }
+  game = current;
+  free(old);
+}
+
+
+/* Sends one message to one client: through the worker's socket
+ * in multi-game mode, otherwise through the message module
+ */
+void sendMessage(addr_t to, const char *message)
+{
+  if (workerSocket >= 0) {
+    sendto(workerSocket, message, strlen(message), 0, (struct sockaddr *)&to, sizeof(to));
+  } else {
+    message_send(to, message);
+  }
+}
+
+
+/* ********************* openBroadcastSocket ********************** */
+/* The message module keeps its socket to itself, so single-game
+ * mode opens a UDP socket of its own to send broadcasts through
+ * with sendmmsg. They come from a port of their own; clients
+ * keep sending to the port message_init reported, where their
+ * messages are still received.
+ *
+ * We return:
+ *   - the socket, or -1 if it cannot be opened; broadcasts then
+ *     fall back to sendMessage
+ */
+int openBroadcastSocket(void)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = 0;  // any free port
+  if (fd >= 0 && bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+/* ********************* sendParts ********************** */
+/* Sends one message given in parts to one client, gathering
+ * them with sendmsg. Without a socket of our own the parts
+ * are joined for the message module.
+ */
+void sendParts(addr_t to, struct iovec *parts, int numParts)
+{
+  int socket = workerSocket >= 0 ? workerSocket : messageSocket;
+  if (numParts == 1) {
+    sendMessage(to, parts[0].iov_base);
+  } else if (socket >= 0) {
+    struct msghdr message = {.msg_name = &to, .msg_namelen = sizeof(to), .msg_iov = parts, .msg_iovlen = numParts};
+    sendmsg(socket, &message, 0);
+  } else {
+    char *joined = malloc(parts[0].iov_len+parts[1].iov_len+1);
+    memcpy(joined, parts[0].iov_base, parts[0].iov_len);
+    memcpy(joined+parts[0].iov_len, parts[1].iov_base, parts[1].iov_len);
+    joined[parts[0].iov_len+parts[1].iov_len] = '\0';
+    message_send(to, joined);
+    free(joined);
+  }
+}
+
+
+/* ********************* broadcastAdd ********************** */
+/* Queues a message for one client. A full broadcast is
+ * flushed first.
+ *
+ * Caller provides:
+ *   - the broadcast
+ *   - address of client
+ *   - the message header, and its body or NULL, both kept
+ *     until the broadcast is flushed
+ */
+void broadcastAdd(broadcast_t *batch, addr_t to, const char *header, const char *body)
+{
+  if (batch->count == MaxPlayers+1) {
+    broadcastFlush(batch);
+  }
+  struct iovec *parts = batch->parts[batch->count];
+  batch->to[batch->count] = to;
+  parts[0].iov_base = (void *)header;
+  parts[0].iov_len = strlen(header);
+  batch->numParts[batch->count] = 1;
+  if (body != NULL) {
+    parts[1].iov_base = (void *)body;
+    parts[1].iov_len = strlen(body);
+    batch->numParts[batch->count] = 2;
+  }
+  batch->count++;
+}
+
+
+/* ********************* broadcastCopy ********************** */
+/* Queues a short message for one client, keeping a copy of it
+ * so the caller may reuse its buffer. Clients sent the same
+ * text share the copy. A message too long to copy is sent
+ * on its own.
+ */
+void broadcastCopy(broadcast_t *batch, addr_t to, const char *text)
+{
+  if (strlen(text) >= BroadcastCopySize) {
+    sendMessage(to, text);
+    return;
+  }
+  if (batch->count == MaxPlayers+1) {
+    broadcastFlush(batch);
+  }
+  int i = 0;
+  while (i < batch->numCopies && strcmp(batch->copies[i], text) != 0) {
+    i++;
+  }
+  if (i == batch->numCopies) {
+    strcpy(batch->copies[batch->numCopies++], text);
+  }
+  broadcastAdd(batch, to, batch->copies[i], NULL);
+}
+
+
+/* ********************* broadcastFlush ********************** */
+/* Sends every queued message with as few sendmmsg calls as the
+ * kernel allows, usually one, and empties the broadcast. A
+ * message the kernel refuses for its destination or size is
+ * dropped, as a lost datagram would be, and the rest still go
+ * out together. On any other failure, such as a full send
+ * buffer, and without a socket of our own, the rest go out one
+ * by one through sendParts.
+ */
+void broadcastFlush(broadcast_t *batch)
+{
+  int sent = 0;
+  if (messageSocket >= 0 && batch->count > 0) {
+    struct mmsghdr messages[MaxPlayers+1];
+    memset(messages, 0, sizeof(struct mmsghdr)*batch->count);
+    for (int i=0; i<batch->count; i++) {
+      messages[i].msg_hdr.msg_name = &batch->to[i];
+      messages[i].msg_hdr.msg_namelen = sizeof(addr_t);
+      messages[i].msg_hdr.msg_iov = batch->parts[i];
+      messages[i].msg_hdr.msg_iovlen = batch->numParts[i];
+    }
+    while (sent < batch->count) {
+      int n = sendmmsg(messageSocket, messages+sent, batch->count-sent, 0);
+      broadcastCalls++;
+      if (n > 0) {
+        sent += n;
+      } else if (errno == ECONNREFUSED || errno == EMSGSIZE || errno == EHOSTUNREACH
+                 || errno == ENETUNREACH || errno == EDESTADDRREQ) {
+        sent++;  // skip the message the kernel refused
+        broadcastDropped++;
+      } else if (errno != EINTR) {
+        break;
+      }
+    }
+  }
+  for (; sent < batch->count; sent++) {
+    sendParts(batch->to[sent], batch->parts[sent], batch->numParts[sent]);
+    broadcastCalls++;
+  }
+  broadcastDatagrams += batch->count;
+  batch->count = 0;
+  batch->numCopies = 0;
+}
+
+
+/* ********************* loggerInit ********************** */
+/* Reads the log level from NUGGETS_LOG and starts the drain
+ * thread. If the thread cannot start, records are dropped.
+ */
+void loggerInit(void)
+{
+  char *level = getenv("NUGGETS_LOG");
+  if (level != NULL) {
+    if (strcmp(level, "error")==0) {
+      logLevel = LogError;
+    } else if (strcmp(level, "debug")==0) {
+      logLevel = LogDebug;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &logStart);
+  atomic_store(&logStopping, false);
+  logRunning = pthread_create(&logThread, NULL, loggerDrain, NULL) == 0;
+  if (!logRunning) {
+    fprintf(stderr, "logger: cannot start drain thread, log is off\n");
+  }
+}
+
+
+/* ********************* loggerDone ********************** */
+/* Stops the drain thread once it has written every record,
+ * after every other thread that logs has finished
+ */
+void loggerDone(void)
+{
+  if (logRunning) {
+    atomic_store_explicit(&logStopping, true, memory_order_release);
+    pthread_join(logThread, NULL);
+    logRunning = false;
+  }
+  for (int r=0; r<atomic_load(&numLogRings); r++) {
+    free(atomic_load(&logRings[r]));
+    atomic_store(&logRings[r], NULL);
+  }
+  atomic_store(&numLogRings, 0);
+  logRing = NULL;
+}
+
+
+/* ********************* logEvent ********************** */
+/* Records an event for the drain thread without waiting:
+ * if the ring is full the record is dropped and counted.
+ * Any thread may call this; each has a ring of its own.
+ *
+ * Caller provides:
+ *   - the level of the event, LogError to LogDebug
+ *   - what happened (LogText, LogNewPlayer, ...)
+ *   - client address, or NULL
+ *   - for LogText, the message; only its first line is kept
+ */
+void logEvent(int level, int event, const addr_t *addr, const char *text)
+{
+  logRecord_t *record = logClaim(level, event, addr);
+  if (record == NULL) {
+    return;
+  }
+  int length = 0;
+  while (text != NULL && length < LogPayload-1 && text[length] != '\0' && text[length] != '\n') {
+    record->payload.text[length] = text[length];
+    length++;
+  }
+  record->payload.text[length] = '\0';
+  logPublish();
+}
+
+
+/* Records a GOLD message as its three numbers */
+void logGold(int level, const addr_t *addr, int n, int p, int r)
+{
+  logRecord_t *record = logClaim(level, LogGold, addr);
+  if (record == NULL) {
+    return;
+  }
+  record->payload.values[0] = n;
+  record->payload.values[1] = p;
+  record->payload.values[2] = r;
+  logPublish();
+}
+
+
+/* Fills in the next record but its payload, or returns NULL
+ * if the level is filtered out or the ring is full.
+ */
+logRecord_t *logClaim(int level, int event, const addr_t *addr)
+{
+  if (level > logLevel) {
+    return NULL;
+  }
+  if (logRing == NULL) {
+    // a thread's first record: give it a ring; there are never more than MaxLogRings threads
+    logRing = calloc(1, sizeof(logRing_t));
+    atomic_store_explicit(&logRings[atomic_fetch_add(&numLogRings, 1)], logRing, memory_order_release);
+  }
+  uint64_t head = atomic_load_explicit(&logRing->head, memory_order_relaxed);
+  if (head-atomic_load_explicit(&logRing->tail, memory_order_acquire) == LogRingSize) {
+    atomic_fetch_add_explicit(&logRing->dropped, 1, memory_order_relaxed);
+    return NULL;
+  }
+  logRecord_t *record = &logRing->records[head & (LogRingSize-1)];
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  record->nanos = (now.tv_sec-logStart.tv_sec)*1000000000LL + (now.tv_nsec-logStart.tv_nsec);
+  record->hasAddr = addr != NULL;
+  if (addr != NULL) {
+    record->ip = addr->sin_addr.s_addr;
+    record->port = addr->sin_port;
+  }
+  record->event = event;
+  return record;
+}
+
+
+/* Hands the record logClaim filled to the drain thread */
+void logPublish(void)
+{
+  uint64_t head = atomic_load_explicit(&logRing->head, memory_order_relaxed);
+  atomic_store_explicit(&logRing->head, head+1, memory_order_release);
+}
+
+
+/* ********************* loggerDrain ********************** */
+/* The drain thread: writes out records as they arrive on each
+ * thread's ring, with a note whenever more have been dropped,
+ * and finishes what is left once loggerDone asks it to stop.
+ */
+void *loggerDrain(void *arg)
+{
+  (void)arg;
+  bool stopping = false;
+  while (!stopping) {
+    // check before reading the heads, so the last pass sees every record
+    stopping = atomic_load_explicit(&logStopping, memory_order_acquire);
+    bool idle = true;
+    int rings = atomic_load(&numLogRings);
+    for (int r=0; r<rings; r++) {
+      logRing_t *ring = atomic_load_explicit(&logRings[r], memory_order_acquire);
+      if (ring == NULL) {
+        continue;  // not stored yet
+      }
+      uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+      uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      idle = idle && tail == head;
+      for (; tail != head; tail++) {
+        loggerWrite(stderr, &ring->records[tail & (LogRingSize-1)]);
+      }
+      atomic_store_explicit(&ring->tail, tail, memory_order_release);
+      uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+      if (dropped != ring->reported) {
+        fprintf(stderr, "logger: %lu records dropped\n", (unsigned long)(dropped-ring->reported));
+        ring->reported = dropped;
+      }
+    }
+    fflush(stderr);
+    if (!stopping && idle) {
+      struct timespec pause = {0, 1000000};  // 1 ms
+      nanosleep(&pause, NULL);
+    }
+  }
+  return NULL;
+}
+
+
+/* Formats one record as "seconds [ip@port]: text" */
+void loggerWrite(FILE *fp, const logRecord_t *record)
+{
+  static const char *eventText[] = {
+    [LogNewSpectator] = "new spectator",
+    [LogSpectatorQuit] = "spectator quit",
+    [LogNewPlayer] = "new player",
+    [LogMaxPlayers] = "NO Max players reached",
+    [LogInvalidKey] = "NO Invalid key",
+    [LogNullArg] = "handleMessage called with arg=NULL",
+  };
+  fprintf(fp, "%4lld.%06lld ", (long long)(record->nanos/1000000000), (long long)(record->nanos%1000000000/1000));
+  if (record->hasAddr) {
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr address = { .s_addr = record->ip };
+    inet_ntop(AF_INET, &address, ip, sizeof(ip));
+    fprintf(fp, "[%s@%05d]: ", ip, ntohs(record->port));
+  }
+  if (record->event == LogText) {
+    fprintf(fp, "%s\n", record->payload.text);
+  } else if (record->event == LogGold) {
+    fprintf(fp, "GOLD %d %d %d\n", record->payload.values[0], record->payload.values[1], record->payload.values[2]);
+  } else {
+    fprintf(fp, "%s\n", eventText[record->event]);
+  }
+}
+
+
+/* ********************* deleteGameInfo ********************** */
+/* Frees the allocated strings and structures in the gameInfo structure
+ *
+ * Caller provides: 
+ *   - pointer to the structure of game information
+ */
+void deleteGameInfo(gameInfo_t *gameInfo)
+{
+  int i=0;
+  // free the players array
+  while (gameInfo->players[i] != NULL) {
+    free(gameInfo->players[i]->map->grids);
+    free(gameInfo->players[i]->map);
+    free(gameInfo->players[i]->past);
+    free(gameInfo->players[i]->realname);
+    free(gameInfo->players[i]);
+    i++;
+  }
+  // free the gold bags array
+  for (int j=0; j<gameInfo->GoldNumPiles; j++) {
+    free(gameInfo->goldBags[j]);
+  }
+  free(gameInfo->goldBags);
+  free(gameInfo->mapRaw->grids);
+  free(gameInfo->mapRaw);
+  free(gameInfo->map->grids);
+  free(gameInfo->map);
+  free(gameInfo->spectator);
+  free(gameInfo);
+  free(game->occupants);
+  // free the frames kept for delta clients
+  for (int j=0; j<=MaxPlayers; j++) {
+    resetClientFrames(&game->clientFrames[j]);
+  }
+  deleteViews();
+}
+
+
+/* ********************* getColRow ********************** */
 /* Calculates the number of columns and rows in a map string
  *
  * Caller provies:
@@ -779,24 +3032,33 @@ void getColRow(char *gridRaw, int *col, int *row)
 
 
 
-/**************** numDigits ****************/
-/* Calculates the number of digits in a number
+/**************** formatInt ****************/
+/* Writes an integer in decimal, without a '\0'
  *
  * Caller provides:
+ *   - buffer with room for 11 characters
  *   - integer
  * We return:
- *   - number of digits in the integer
+ *   - number of characters written
  * Note:
- *   - this is used to calculate the amound of space
- *     needed to malloc a string that will contain
- *     an integer     
+ *   - this replaces sprintf when building messages,
+ *     so they can be written straight into place
  */
-int numDigits(int num)
+int formatInt(char *out, int num)
 {
-  int dig=1;
-  while(num/10 > 0) {
-    dig++;  // increase digit count by 1 for each time you can divide by 10
-    num=num/10;
+  char digits[10];
+  unsigned int rest = num < 0 ? -(unsigned int)num : (unsigned int)num;
+  int dig = 0;
+  int length = 0;
+  do {
+    digits[dig++] = '0'+rest%10;  // lowest digit first
+    rest /= 10;
+  } while (rest > 0);
+  if (num < 0) {
+    out[length++] = '-';
+  }
+  while (dig > 0) {
+    out[length++] = digits[--dig];
   }
-  return (dig);
+  return length;
 }